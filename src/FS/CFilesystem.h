@@ -85,6 +85,8 @@ class CFilesystem
         virtual void Rename(const CPath &path, CDirectoryPtr newdir, const std::string &filename)=0;
         virtual void Unlink(const CPath &path)=0;
         virtual void StatFS(CStatFS *buf)=0;
+        // returns when all changes so far are on stable storage
+        virtual void Sync()=0;
 
         virtual void PrintInfo()=0;
         virtual void PrintFragments()=0;
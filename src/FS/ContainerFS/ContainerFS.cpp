@@ -79,6 +79,11 @@ void ContainerFS::StatFS(CStatFS *buf)
     buf->f_files  = 1;
 }
 
+void ContainerFS::Sync()
+{
+    bio->Sync(true);
+}
+
 // ----------------------------------------------------
 
 CInodePtr ContainerFS::OpenNode(const CPath &path)
@@ -30,6 +30,7 @@ public:
     void Rename(const CPath &path, CDirectoryPtr newdir, const std::string &filename) override;
     void Unlink(const CPath &path) override;
     void StatFS(CStatFS *buf) override;
+    void Sync() override;
 
 private:
     std::shared_ptr<CCacheIO> bio;
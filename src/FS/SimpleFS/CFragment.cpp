@@ -20,16 +20,15 @@ void CFragmentList::Load()
 
     fragments.assign(nentries, CFragmentDesc(INODETYPE::undefined, CFragmentDesc::FREEID, 0, 0));
 
+    std::vector<int8_t> buf(bio->blocksize);
     for(unsigned int i=0; i<nfragmentblocks; i++)
     {
         int nidsperblock = bio->blocksize / CFragmentDesc::SIZEONDISK;
-        CBLOCKPTR block = fragmentblocks[i];
-        int8_t* buf = block->GetBufRead();
+        fragmentblocks[i]->ReadBuf(0, bio->blocksize, buf.data());
         for(int j=0; j<nidsperblock; j++)
         {
             fragments[i*nidsperblock + j] = CFragmentDesc(&buf[j*CFragmentDesc::SIZEONDISK]);
         }
-        block->ReleaseBuf();
     }
     SortOffsets();
 }
@@ -80,6 +79,7 @@ void CFragmentList::FreeAllFragments(std::vector<int> &ff)
     std::lock_guard<std::mutex> lock(fragmentsmtx);
     for (int f : ff)
     {
+        bio->Discard(fragments[f].ofs, fragments[f].GetNBlocks(bio->blocksize));
         fragments[f].id = CFragmentDesc::FREEID;
         fragments[f].type = INODETYPE::undefined;
         StoreFragment(f);
@@ -29,6 +29,7 @@ class CFragmentDesc
     }
 
     uint64_t GetNextFreeBlock(int blocksize) const { return  ofs + (size-1)/blocksize + 1; };
+    int GetNBlocks(int blocksize) const { return ((int64_t)size + blocksize - 1)/blocksize; }; // which contain data
 
     INODETYPE type;
     int32_t id;
@@ -42,6 +43,7 @@ class CFragmentDesc
     static const int32_t TABLEID      = -2; // contains the layout tables of the whole filesystem
     static const int32_t SUPERID      = -3; // id of the super block
     static const int32_t INVALIDID    = -4; // defines an invalid id like the parent dir of the root directory
+    static const int32_t ZEROMAPID    = -5; // bitmap of the blocks which contain only zeros
 };
 
 class CFragmentList
@@ -10,15 +10,21 @@
 /*
 TODO:
     - faster sorted offset list
-    - readahead
     - remove should check for shared_ptr number of pointers
     - gcrypt mode is not xts?
     - ReleaseBuf on destroy???
-    - limit Cache size
 */
 
 // -------------------------------------------------------------
 
+static const int64_t MINREADAHEAD = 128*1024;
+static const int64_t MAXREADAHEAD = 4*1024*1024;
+static const int64_t ZEROMAPHEADROOM = 100LL * 0x40000000LL; // the container may grow by this much, as in StatFS
+// 1.1: blocks marked in the zero map are not stored. Clients which don't know the map
+// would read and write them, so they must not mount such a volume.
+static const int32_t FSVERSION = (1<<16) | 1;
+
+// -------------------------------------------------------------
 
 class CFragmentOverlap
 {
@@ -43,7 +49,7 @@ typedef struct
     int32_t version;
 } SUPER;
 
-CSimpleFilesystem::CSimpleFilesystem(const std::shared_ptr<CCacheIO> &_bio) : bio(_bio), fragmentlist(_bio)
+CSimpleFilesystem::CSimpleFilesystem(const std::shared_ptr<CCacheIO> &_bio, const CSimpleFSConfig &_config) : bio(_bio), config(_config), fragmentlist(_bio)
 {
     static_assert(sizeof(CDirectoryEntryOnDisk) == 128, "");
     static_assert(CFragmentDesc::SIZEONDISK == 16, "");
@@ -63,18 +69,24 @@ CSimpleFilesystem::CSimpleFilesystem(const std::shared_ptr<CCacheIO> &_bio) : bi
     LOG(LogLevel::INFO) << "  size: " << int(bio->GetFilesize()/(1024*1024)) << " MB";
     LOG(LogLevel::INFO) << "  blocksize: " << bio->blocksize << " bytes";
 
-    CBLOCKPTR superblock = bio->GetBlock(1);
-    SUPER * super = (SUPER*)superblock->GetBufRead();
-    if (strncmp(super->magic, "CoverFS", 7) != 0)
+    SUPER super;
+    bio->GetBlock(1)->ReadBuf(0, sizeof(SUPER), (int8_t*)&super);
+    if (strncmp(super.magic, "CoverFS", 7) != 0)
     {
-        superblock->ReleaseBuf();
         CreateFS();
+        AttachZeroMap();
         return;
     }
-    LOG(LogLevel::INFO) << "filesystem " << super->magic << " V" << (super->version>>16) << "." << (super->version|0xFFFF);
-    superblock->ReleaseBuf();
+    int32_t version = super.version;
+    LOG(LogLevel::INFO) << "filesystem " << super.magic << " V" << (version>>16) << "." << (version&0xFFFF);
+    if (version > FSVERSION)
+    {
+        LOG(LogLevel::ERR) << "Filesystem version " << (version>>16) << "." << (version&0xFFFF) << " is not supported";
+        throw std::exception();
+    }
 
     fragmentlist.Load();
+    AttachZeroMap();
 }
 
 CSimpleFilesystem::~CSimpleFilesystem()
@@ -118,7 +130,7 @@ void CSimpleFilesystem::CreateFS()
     SUPER* super = (SUPER*)superblock->GetBufReadWrite();
     memset(super, 0, sizeof(SUPER));
     strncpy(super->magic, "CoverFS", 8);
-    super->version = (1<<16) | 0;
+    super->version = FSVERSION;
     superblock->ReleaseBuf();
     bio->Sync();
     fragmentlist.Create();
@@ -155,6 +167,78 @@ void CSimpleFilesystem::CreateFS()
     LOG(LogLevel::INFO) << "==================";
 }
 
+// The zero map is stored in the ZEROMAPID fragments in the order of their index. It covers the
+// container and its headroom and grows with the container on every writable mount. Older
+// containers get a map only on request, because older clients must not mount them afterwards.
+void CSimpleFilesystem::AttachZeroMap()
+{
+    CBLOCKPTR superblock = bio->GetBlock(1);
+    SUPER super;
+    superblock->ReadBuf(0, sizeof(SUPER), (int8_t*)&super);
+    int32_t version = super.version;
+    if ((version < FSVERSION) && (config.readonly || !config.zeromap))
+    {
+        LOG(LogLevel::INFO) << "No zero map. Mount the volume with --zeromap to add one";
+        return;
+    }
+
+    std::vector<int> list;
+    int64_t size = 0;
+    fragmentlist.GetFragmentIdxList(CFragmentDesc::ZEROMAPID, list, size);
+
+    // a map, which is older than the version, is outdated. Nothing is known to be zero
+    std::vector<int> clear;
+    if (version < FSVERSION) clear = list;
+
+    int64_t nbitsperblock = bio->blocksize*8;
+    int64_t nmapblocks = ((bio->GetFilesize()+ZEROMAPHEADROOM)/bio->blocksize + nbitsperblock-1) / nbitsperblock;
+    if (!config.readonly && (size < nmapblocks*bio->blocksize))
+    {
+        LOG(LogLevel::INFO) << "Grow zero map to " << nmapblocks << " blocks";
+        std::lock_guard<std::mutex> lock(fragmentlist.fragmentsmtx);
+        while(size < nmapblocks*bio->blocksize)
+        {
+            int idx = fragmentlist.ReserveNextFreeFragment(list.empty()?1:list.back(), CFragmentDesc::ZEROMAPID, INODETYPE::special, nmapblocks*bio->blocksize-size);
+            fragmentlist.StoreFragment(idx);
+            fragmentlist.SortOffsets();
+            list.push_back(idx);
+            clear.push_back(idx);
+            size += fragmentlist.fragments[idx].size;
+        }
+    }
+    for(auto idx : clear)
+    {
+        CFragmentDesc &fd = fragmentlist.fragments[idx];
+        for(int64_t i=0; i<fd.size/bio->blocksize; i++)
+        {
+            CBLOCKPTR block = bio->GetBlock(fd.ofs+i, false);
+            memset(block->GetBufReadWrite(), 0, bio->blocksize);
+            block->ReleaseBuf();
+        }
+    }
+    if (!clear.empty()) bio->Sync();
+    if (list.empty()) return;
+
+    // from now on clients without zero map support refuse the volume
+    if (version < FSVERSION)
+    {
+        LOG(LogLevel::INFO) << "Update filesystem to V" << (FSVERSION>>16) << "." << (FSVERSION&0xFFFF);
+        ((SUPER*)superblock->GetBufReadWrite())->version = FSVERSION;
+        superblock->ReleaseBuf();
+        bio->Sync(true);
+    }
+
+    std::vector<CBlockExtent> extents;
+    for(auto idx : list)
+    {
+        CFragmentDesc &fd = fragmentlist.fragments[idx];
+        extents.push_back(CBlockExtent{int(fd.ofs), int(fd.size/bio->blocksize), nullptr});
+    }
+    // the superblock and the fragment table are read before the map is available
+    int64_t firstblock = fragmentlist.fragments[1].GetNextFreeBlock(bio->blocksize);
+    bio->AttachZeroMap(extents, firstblock);
+}
+
 CSimpleFSInodePtr CSimpleFilesystem::OpenNodeInternal(int id)
 {
     std::lock_guard<std::mutex> lock(inodescachemtx);
@@ -291,9 +375,13 @@ void CSimpleFilesystem::ShrinkNode(CSimpleFSInode &node, int64_t size)
     {
         int lastidx = node.fragments.back();
         CFragmentDesc &r = fragmentlist.fragments[lastidx];
+        int nblocks = r.GetNBlocks(bio->blocksize);
         node.size -= r.size;
         r.size = std::max(size - node.size, (int64_t)0);
         node.size += r.size;
+        // the blocks behind the new end are free
+        int nused = r.GetNBlocks(bio->blocksize);
+        bio->Discard(r.ofs + nused, nblocks - nused);
 
         if ((r.size == 0) && (node.size != 0)) // don't remove last element
         {
@@ -371,10 +459,51 @@ int64_t CSimpleFilesystem::Read(CSimpleFSInode &node, int8_t *d, int64_t ofs, in
         }
         fragmentofs += fragmentlist.fragments[idx].size;
     }
+    ReadAhead(node, ofs, size);
     //bio->Sync();
     return s;
 }
 
+void CSimpleFilesystem::ReadAhead(CSimpleFSInode &node, int64_t ofs, int64_t size)
+{
+    if (node.type != INODETYPE::file) return;
+    int64_t end = ofs+size;
+    if (ofs != node.nextreadofs)
+    {
+        // random access. Stop the readahead
+        node.nextreadofs = end;
+        node.readaheadwindow = 0;
+        node.readaheadofs = end;
+        return;
+    }
+    node.nextreadofs = end;
+
+    // wait until half of the window is consumed, then double the window
+    int64_t raofs = std::max(node.readaheadofs, end);
+    if ((node.readaheadwindow != 0) && (raofs-end >= node.readaheadwindow/2)) return;
+    if (node.readaheadwindow == 0)
+        node.readaheadwindow = std::max(size*2, MINREADAHEAD);
+    else
+        node.readaheadwindow = std::min(node.readaheadwindow*2, MAXREADAHEAD);
+
+    int64_t raend = std::min(end+node.readaheadwindow, node.size);
+    if (raend <= raofs) return;
+    node.readaheadofs = raend;
+
+    // the prefetch follows the fragments into the container
+    int64_t fragmentofs = 0x0;
+    for (int idx : node.fragments) {
+        CFragmentOverlap intersect;
+        if (FindIntersect(CFragmentOverlap(fragmentofs, fragmentlist.fragments[idx].size), CFragmentOverlap(raofs, raend-raofs), intersect))
+        {
+            bio->Prefetch(
+                fragmentlist.fragments[idx].ofs*bio->blocksize + (intersect.ofs - fragmentofs),
+                intersect.size);
+        }
+        fragmentofs += fragmentlist.fragments[idx].size;
+    }
+}
+
 void CSimpleFilesystem::Write(CSimpleFSInode &node, const int8_t *d, int64_t ofs, int64_t size)
 {
     nwritten++;
@@ -512,6 +641,11 @@ void CSimpleFilesystem::StatFS(CStatFS *buf)
     buf->f_files  = s.size();
 }
 
+void CSimpleFilesystem::Sync()
+{
+    bio->Sync(true);
+}
+
 CInodePtr CSimpleFilesystem::OpenNode(int id)
 {
     return OpenNodeInternal(id);
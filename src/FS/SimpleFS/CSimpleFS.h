@@ -18,6 +18,12 @@
 
 // ----------------------------------------------------------
 
+struct CSimpleFSConfig
+{
+    bool readonly = false; // the volume is only inspected. Nothing is migrated
+    bool zeromap = false; // add a zero map to an older volume. Older clients can't mount it afterwards
+};
+
 class CSimpleFilesystem : public CFilesystem
 {
     friend class CSimpleFSDirectory;
@@ -25,7 +31,7 @@ class CSimpleFilesystem : public CFilesystem
     friend class CPrintCheckRepair;
 
 public:
-    explicit CSimpleFilesystem(const std::shared_ptr<CCacheIO> &_bio);
+    explicit CSimpleFilesystem(const std::shared_ptr<CCacheIO> &_bio, const CSimpleFSConfig &_config = CSimpleFSConfig());
     ~CSimpleFilesystem();
 
     CInodePtr OpenNode(const CPath &path) override;
@@ -40,12 +46,14 @@ public:
     void Rename(const CPath &path, CDirectoryPtr newdir, const std::string &filename) override;
     void Unlink(const CPath &path) override;
     void StatFS(CStatFS *buf) override;
+    void Sync() override;
 
     void PrintInfo() override;
     void PrintFragments() override;
     void Check() override;
 
     void CreateFS();
+    void AttachZeroMap();
 
     int64_t GetNInodes();
 
@@ -60,6 +68,7 @@ private:
     int MakeFile(CSimpleFSDirectory& dir, const std::string& name);
 
     int64_t Read(CSimpleFSInode &node, int8_t *d, int64_t ofs, int64_t size);
+    void ReadAhead(CSimpleFSInode &node, int64_t ofs, int64_t size);
     void Write(CSimpleFSInode &node, const int8_t *d, int64_t ofs, int64_t size);
     void Truncate(CSimpleFSInode &node, int64_t size, bool dozero);
 
@@ -72,6 +81,7 @@ private:
     void MaybeRemove(CSimpleFSInode &node);
 
     std::shared_ptr<CCacheIO> bio;
+    CSimpleFSConfig config;
 
     std::mutex inodescachemtx;
 
@@ -18,7 +18,7 @@ class CSimpleFSInode : public CInode
     friend class CSimpleFilesystem;
 
 public:
-    explicit CSimpleFSInode(CSimpleFilesystem &_fs) : id(-4), parentid(-4), size(0), nlinks(1), type(INODETYPE::undefined), fs(_fs) {}
+    explicit CSimpleFSInode(CSimpleFilesystem &_fs) : id(-4), parentid(-4), size(0), nlinks(1), type(INODETYPE::undefined), nextreadofs(0), readaheadwindow(0), readaheadofs(0), fs(_fs) {}
 
     virtual ~CSimpleFSInode();
 
@@ -46,6 +46,11 @@ private:
     std::string name;
     std::vector<int> fragments;
 
+    // sequential read detection for the readahead
+    int64_t nextreadofs;     // a read starting here is sequential
+    int64_t readaheadwindow; // 0 means no readahead
+    int64_t readaheadofs;    // readahead is issued up to this offset
+
     std::mutex mtx;
     CSimpleFilesystem &fs;
 
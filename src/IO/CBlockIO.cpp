@@ -3,39 +3,116 @@
 
 CAbstractBlockIO::CAbstractBlockIO(int _blocksize) : blocksize(_blocksize) {}
 int64_t CAbstractBlockIO::GetWriteCache() { return 0; }
+void CAbstractBlockIO::Flush() {}
+void CAbstractBlockIO::Discard(const std::vector<CBlockExtent> &extents) {}
+
+void CAbstractBlockIO::WriteShared(const int blockidx, const int n, const std::shared_ptr<const std::vector<int8_t>> &d)
+{
+    Write(blockidx, n, const_cast<int8_t*>(d->data()));
+}
+
+// Devices without a native implementation complete the read before returning
+std::future<void> CAbstractBlockIO::ReadAsync(const int blockidx, const int n, int8_t *d)
+{
+    std::promise<void> promise;
+    try
+    {
+        Read(blockidx, n, d);
+        promise.set_value();
+    } catch(...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+void CAbstractBlockIO::ReadV(const std::vector<CBlockExtent> &extents)
+{
+    for(auto &e : extents) Read(e.blockidx, e.n, e.d);
+}
+
+std::future<void> CAbstractBlockIO::ReadVAsync(const std::vector<CBlockExtent> &extents)
+{
+    std::promise<void> promise;
+    try
+    {
+        ReadV(extents);
+        promise.set_value();
+    } catch(...)
+    {
+        promise.set_exception(std::current_exception());
+    }
+    return promise.get_future();
+}
+
+void CAbstractBlockIO::WriteV(const std::vector<CBlockExtent> &extents)
+{
+    for(auto &e : extents) Write(e.blockidx, e.n, e.d);
+}
 
 // -----------------------------------------------------------------
 
 CRAMBlockIO::CRAMBlockIO(int _blocksize) : CAbstractBlockIO(_blocksize)
 {
-    data.assign(blocksize*3, 0xFF);
+    blocks.resize(3);
 }
 
 int64_t CRAMBlockIO::GetFilesize()
 {
     std::lock_guard<std::mutex> lock(mutex);
-    return data.size();
+    return (int64_t)blocks.size()*blocksize;
 }
 
+// Blocks which were never written or were discarded read as 0xFF
+int8_t* CRAMBlockIO::GetBlock(const int blockidx)
+{
+    if (!blocks[blockidx])
+    {
+        blocks[blockidx].reset(new int8_t[blocksize]);
+        memset(blocks[blockidx].get(), 0xFF, blocksize);
+    }
+    return blocks[blockidx].get();
+}
 
 void CRAMBlockIO::Read(const int blockidx, const int n, int8_t *d)
 {
-    uint64_t newsize = (blockidx+n)*blocksize;
+    size_t newsize = blockidx+n;
     std::lock_guard<std::mutex> lock(mutex);
-    if (newsize > data.size())
+    if (newsize > blocks.size())
+    {
+        blocks.resize((newsize*3)/2);
+    }
+    for(int i=0; i<n; i++)
     {
-        data.resize((newsize*3)/2, 0xFF);
+        if (blocks[blockidx+i])
+            memcpy(&d[(int64_t)i*blocksize], blocks[blockidx+i].get(), blocksize);
+        else
+            memset(&d[(int64_t)i*blocksize], 0xFF, blocksize);
     }
-    memcpy(d, &data[blockidx*blocksize], n*blocksize);
 }
 
 void CRAMBlockIO::Write(const int blockidx, const int n, int8_t* d)
 {
-    uint64_t newsize = (blockidx+n)*blocksize;
+    size_t newsize = blockidx+n;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (newsize > blocks.size())
+    {
+        blocks.resize((newsize*3)/2);
+    }
+    for(int i=0; i<n; i++)
+    {
+        memcpy(GetBlock(blockidx+i), &d[(int64_t)i*blocksize], blocksize);
+    }
+}
+
+void CRAMBlockIO::Discard(const std::vector<CBlockExtent> &extents)
+{
     std::lock_guard<std::mutex> lock(mutex);
-    if (newsize > data.size())
+    for(auto &e : extents)
     {
-        data.resize((newsize*3)/2, 0xFF);
+        for(int i=e.blockidx; (i < e.blockidx+e.n) && (i < (int)blocks.size()); i++)
+        {
+            blocks[i].reset();
+        }
     }
-    memcpy(&data[blockidx*blocksize], d, n*blocksize);
 }
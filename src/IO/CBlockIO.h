@@ -4,18 +4,42 @@
 #include<vector>
 #include<memory>
 #include<mutex>
+#include<future>
 #include<cstdint>
 #include<cstdlib>
 
 
 class CAbstractBlockIO;
 
+// Contiguous run of blocks of a vectored request together with its buffer
+class CBlockExtent
+{
+public:
+    int blockidx;
+    int n;
+    int8_t *d;
+    std::shared_ptr<const void> owner; // optional. Keeps d alive, so that writes can send it without a copy
+};
+
 class CAbstractBlockIO
 {
 public:
     explicit CAbstractBlockIO(int _blocksize);
     virtual void Read(int blockidx, int n, int8_t* d) = 0;
+    // The future is ready when d is filled. d must stay valid until then.
+    virtual std::future<void> ReadAsync(int blockidx, int n, int8_t* d);
     virtual void Write(int blockidx, int n, int8_t* d) = 0;
+    // The block device may keep d until the data is sent. The caller must not modify it anymore.
+    virtual void WriteShared(int blockidx, int n, const std::shared_ptr<const std::vector<int8_t>> &d);
+    // Vectored requests. The default implementations loop over the extents
+    virtual void ReadV(const std::vector<CBlockExtent> &extents);
+    virtual std::future<void> ReadVAsync(const std::vector<CBlockExtent> &extents);
+    virtual void WriteV(const std::vector<CBlockExtent> &extents);
+    // Returns when everything written before is on stable storage
+    virtual void Flush();
+    // The extents are not used anymore and need no storage. Their content is undefined
+    // until they are written again. d is not used.
+    virtual void Discard(const std::vector<CBlockExtent> &extents);
     virtual int64_t GetFilesize() = 0;
     virtual int64_t GetWriteCache();
 
@@ -30,10 +54,12 @@ public:
     explicit CRAMBlockIO(int _blocksize);
     void Read(int blockidx, int n, int8_t* d) override;
     void Write(int blockidx, int n, int8_t* d) override;
+    void Discard(const std::vector<CBlockExtent> &extents) override;
     int64_t GetFilesize() override;
 
 private:
-    std::vector<int8_t> data;
+    int8_t* GetBlock(int blockidx); // must be called with the mutex held
+    std::vector<std::unique_ptr<int8_t[]>> blocks; // allocated when written
     std::mutex mutex;
 };
 
@@ -1,160 +1,500 @@
 #include"Logger.h"
 #include "CCacheIO.h"
 #include <cassert>
+#include <algorithm>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 // -----------------------------------------------------------------
 
-CBlock::CBlock(CCacheIO &_cio, CEncrypt &_enc, int _blockidx, int size) : nextdirtyidx(-1), blockidx(_blockidx), cio(_cio), enc(_enc), buf(size), count(0)
-{}
+static bool IsZeroBlock(const int8_t *d, int size)
+{
+    assert((size%64) == 0);
+#ifdef __SSE2__
+    __m128i acc = _mm_setzero_si128();
+    for(int i=0; i<size; i+=64)
+    {
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&d[i+0])));
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&d[i+16])));
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&d[i+32])));
+        acc = _mm_or_si128(acc, _mm_loadu_si128(reinterpret_cast<const __m128i*>(&d[i+48])));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) == 0xFFFF;
+#else
+    uint64_t acc = 0;
+    for(int i=0; i<size; i+=8)
+    {
+        uint64_t v;
+        memcpy(&v, &d[i], 8);
+        acc |= v;
+    }
+    return acc == 0;
+#endif
+}
 
-int8_t* CBlock::GetBufRead()
+// -----------------------------------------------------------------
+
+CBlock::CBlock(CCacheIO &_cio, int _blockidx, int8_t *_buf) : nextdirtyidx(-1), dirty(false), discarded(false), written(false), loadseq(0), blockidx(_blockidx), cio(_cio), buf(_buf), queue(CACHEQUEUE::A1IN)
 {
-    mutex.lock();
-    count++;
-    if (cio.cryptcache)
-        enc.Decrypt(blockidx, &buf[0]);
-    return &buf[0];
+    memset(buf, 0, cio.blocksize);
 }
 
+CBlock::~CBlock()
+{
+    cio.bufferslab.Free(buf);
+}
+
+// Writers get exclusive access. Readers share the block through ReadBuf.
 int8_t* CBlock::GetBufReadWrite()
 {
-    int8_t* buf = GetBufRead();
-    if (nextdirtyidx == -1)
+    mutex.lock();
+    written = true;
+    discarded = false;
+    if (cio.cryptcache)
+        cio.enc.Decrypt(blockidx, buf);
+    if (!dirty)
     {
-        nextdirtyidx = cio.lastdirtyidx.exchange(blockidx, std::memory_order_relaxed);
+        dirty = true;
         cio.ndirty++;
+        nextdirtyidx = cio.lastdirtyidx.exchange(blockidx, std::memory_order_relaxed);
     }
     return buf;
 }
 
 int8_t* CBlock::GetBufUnsafe()
 {
-    return &buf[0];
+    return buf;
 }
 
-
 void CBlock::ReleaseBuf()
 {
     if (cio.cryptcache)
-        enc.Encrypt(blockidx, &buf[0]);
+        cio.enc.Encrypt(blockidx, buf);
     mutex.unlock();
 }
 
+// Copies part of the block to d. The block is never modified, even with an encrypted cache,
+// so any number of threads can read it at the same time.
+void CBlock::ReadBuf(int ofs, int size, int8_t *d)
+{
+    assert((ofs >= 0) && (size >= 0) && (ofs+size <= cio.blocksize));
+    std::shared_lock<std::shared_timed_mutex> lock(mutex);
+    if (!cio.cryptcache)
+    {
+        memcpy(d, &buf[ofs], size);
+        return;
+    }
+    if (size == cio.blocksize)
+    {
+        memcpy(d, buf, size);
+        cio.enc.Decrypt(blockidx, d);
+        return;
+    }
+    static thread_local std::vector<int8_t> plain;
+    plain.resize(cio.blocksize);
+    memcpy(plain.data(), buf, cio.blocksize);
+    cio.enc.Decrypt(blockidx, plain.data());
+    memcpy(d, &plain[ofs], size);
+}
+
 // -----------------------------------------------------------------
 
-CCacheIO::CCacheIO(const std::shared_ptr<CAbstractBlockIO> &_bio, CEncrypt &_enc, bool _cryptcache) :
-    bio(_bio), enc(_enc), ndirty(0), lastdirtyidx(-1), terminatesyncthread(false), cryptcache(_cryptcache)
+CCacheIO::CCacheIO(const std::shared_ptr<CAbstractBlockIO> &_bio, CEncrypt &_enc, bool _cryptcache, const CCacheConfig &_config) :
+    bio(_bio), enc(_enc),
+    bufferslab(_bio->blocksize, SLABCHUNKSIZE, _config.hugepages, _config.lockmemory, NSLABSTRIPES),
+    blockslab(CBlockAllocator::SLOTBYTES, SLABCHUNKSIZE, _config.hugepages, _config.lockmemory, NSLABSTRIPES),
+    ndirty(0), lastdirtyidx(-1), terminatesyncthread(false), syncrequested(false), syncwanted(0), syncdone(0), syncjobs(0), terminatepipeline(false), njobsqueued(0), njobssubmitted(0), terminateprefetchthread(false), writebackrate(0.), nthrottled(0), zeromapfirst(0), zeromapbits(0), nzeroblocks(0), cryptcache(_cryptcache)
 {
     blocksize = bio->blocksize;
+    bypasssize = _config.bypasssize;
+    bypasspopulate = _config.bypasspopulate;
+    writearoundsize = _config.writearoundsize;
+    // dirty blocks cannot be evicted. Keep some room for the clean ones
+    dirtyhigh = std::max<int64_t>(std::min<int64_t>(_config.dirtyhigh, _config.maxcachesize/2)/blocksize, MAXWRITERUN*4);
+    dirtylow = std::min<int64_t>(std::max<int64_t>(_config.dirtylow/blocksize, 0), dirtyhigh-1);
+    LOG(LogLevel::INFO) << "Cache: dirty watermarks " << dirtylow << " and " << dirtyhigh << " blocks";
+    int64_t maxblocks = std::max<int64_t>(_config.maxcachesize/blocksize, NSHARDS*16);
+    for(auto &shard : shards) shard.maxblocks = maxblocks/NSHARDS;
+    LOG(LogLevel::INFO) << "Cache: limit to " << maxblocks << " blocks (" << (maxblocks*blocksize)/(1024*1024) << " MB)";
+
+    int nthreads = _config.writebackthreads;
+    if (nthreads <= 0) nthreads = std::min(std::max<int>(std::thread::hardware_concurrency(), 1), 8);
+    maxjobs = nthreads*4;
+    LOG(LogLevel::INFO) << "Cache: " << nthreads << " writeback threads";
+    for(int i=0; i<nthreads; i++)
+        encryptthreads.emplace_back(&CCacheIO::Async_Encrypt, this);
+    submitthread = std::thread(&CCacheIO::Async_Submit, this);
     syncthread = std::thread(&CCacheIO::Async_Sync, this);
+    prefetchthread = std::thread(&CCacheIO::Async_Prefetch, this);
 }
 
 CCacheIO::~CCacheIO()
 {
     LOG(LogLevel::DEBUG) << "Cache: destruct";
+    {
+        std::lock_guard<std::mutex> lock(prefetchmtx);
+        terminateprefetchthread = true;
+        prefetchcond.notify_one();
+    }
+    prefetchthread.join();
     terminatesyncthread.store(true);
     Sync();
     syncthread.join();
+    {
+        std::lock_guard<std::mutex> lock(jobmtx);
+        terminatepipeline = true;
+        jobcond.notify_all();
+    }
+    for(auto &t : encryptthreads) t.join();
+    submitthread.join();
+    bio->Flush();
     assert(ndirty.load() == 0);
     LOG(LogLevel::DEBUG) << "All Blocks stored. Erase cache ...";
+    LOG(LogLevel::INFO) << "Cache hits: " << GetNCacheHits() << " misses: " << GetNCacheMisses() << " evictions: " << GetNEvictions() << " throttled writes: " << nthrottled.load() << " zero blocks: " << nzeroblocks.load();
 
-    cachemtx.lock();
-    for(auto iter = cache.begin(); iter != cache.end();)
+    bool empty = true;
+    for(auto &shard : shards)
     {
-        CBLOCKPTR block = iter->second;
-        if (block.use_count() != 2)
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        for(auto iter = shard.blocks.begin(); iter != shard.blocks.end();)
         {
-            LOG(LogLevel::WARN) << "Block " << block->blockidx << " still in use.";
-            iter++;
-            continue;
+            CBLOCKPTR block = iter->second;
+            if (block.use_count() != 2)
+            {
+                LOG(LogLevel::WARN) << "Block " << block->blockidx << " still in use.";
+                iter++;
+                continue;
+            }
+            if (!block->mutex.try_lock())
+            {
+                LOG(LogLevel::WARN) << "Locking block " << block->blockidx << " failed.";
+                iter++;
+                continue;
+            }
+            if (block->queue == CACHEQUEUE::A1IN) shard.a1in.erase(block->queueit); else shard.am.erase(block->queueit);
+            iter = shard.blocks.erase(iter);
+            block->mutex.unlock();
         }
-        if (!block->mutex.try_lock())
+        if (!shard.blocks.empty()) empty = false;
+    }
+    LOG(LogLevel::DEBUG) << "Cache erased";
+
+    if (!empty)
+    {
+        LOG(LogLevel::WARN) << "Cache not empty";
+    }
+}
+
+// -----------------------------------------------------------------
+// 2Q eviction. All functions expect the mutex of the shard to be locked.
+
+CBLOCKPTR CCacheIO::NewBlock(CCacheShard &shard, const int blockidx)
+{
+    // block and reference counter share one slot in the slab. Each shard allocates from its own stripe
+    int stripe = blockidx % NSHARDS;
+    CBLOCKPTR block = std::allocate_shared<CBlock>(CBlockAllocator(blockslab, stripe), *this, blockidx, static_cast<int8_t*>(bufferslab.Allocate(stripe)));
+    shard.blocks[blockidx] = block;
+    block->loadseq = njobssubmitted.load();
+
+    auto ghost = shard.a1outidx.find(blockidx);
+    if (ghost != shard.a1outidx.end())
+    {
+        // evicted from a1in not long ago. So this is a hot block
+        shard.a1out.erase(ghost->second);
+        shard.a1outidx.erase(ghost);
+        block->queue = CACHEQUEUE::AM;
+        block->queueit = shard.am.insert(shard.am.begin(), blockidx);
+    } else
+    {
+        block->queue = CACHEQUEUE::A1IN;
+        block->queueit = shard.a1in.insert(shard.a1in.begin(), blockidx);
+    }
+    return block;
+}
+
+void CCacheIO::Touch(CCacheShard &shard, CBlock &block)
+{
+    shard.nhits++;
+    // blocks in a1in stay in fifo order. Only am is handled as lru list
+    if (block.queue == CACHEQUEUE::AM)
+        shard.am.splice(shard.am.begin(), shard.am, block.queueit);
+}
+
+bool CCacheIO::EvictFrom(CCacheShard &shard, std::list<int> &queue)
+{
+    // Walk from the oldest entry. Blocks which are dirty or in use somewhere else
+    // cannot be evicted and get a second chance at the front of the list.
+    for(size_t i=queue.size(); i>0; i--)
+    {
+        int blockidx = queue.back();
+        auto cacheblock = shard.blocks.find(blockidx);
+        assert(cacheblock != shard.blocks.end());
+        CBlock &block = *cacheblock->second;
+
+        // Every user of a block, including the sync thread, holds a reference.
+        if ((cacheblock->second.use_count() != 1) || block.dirty)
         {
-            LOG(LogLevel::WARN) << "Locking block " << block->blockidx << " failed.";
-            iter++;
+            queue.splice(queue.begin(), queue, block.queueit);
             continue;
         }
-        iter = cache.erase(iter);
-        block->mutex.unlock();
+
+        if (block.queue == CACHEQUEUE::A1IN)
+        {
+            shard.a1outidx[blockidx] = shard.a1out.insert(shard.a1out.begin(), blockidx);
+            while(shard.a1out.size() > shard.maxblocks/2)
+            {
+                shard.a1outidx.erase(shard.a1out.back());
+                shard.a1out.pop_back();
+            }
+        }
+        queue.pop_back();
+        shard.blocks.erase(cacheblock);
+        shard.nevictions++;
+        return true;
     }
-    LOG(LogLevel::DEBUG) << "Cache erased";
+    return false;
+}
 
-    if (!cache.empty())
+void CCacheIO::Evict(CCacheShard &shard)
+{
+    while(shard.blocks.size() > shard.maxblocks)
     {
-        LOG(LogLevel::WARN) << "Cache not empty";
+        if ((shard.a1in.size() > shard.maxblocks/4) && EvictFrom(shard, shard.a1in)) continue;
+        if (EvictFrom(shard, shard.am)) continue;
+        if (EvictFrom(shard, shard.a1in)) continue;
+        // everything is pinned or dirty. Try again later.
+        return;
     }
-    cachemtx.unlock();
 }
 
+// -----------------------------------------------------------------
+
 CBLOCKPTR CCacheIO::GetBlock(const int blockidx, bool read)
 {
-    cachemtx.lock();
-    auto cacheblock = cache.find(blockidx);
-    if (cacheblock != cache.end())
+    CCacheShard &shard = GetShard(blockidx);
+    shard.mtx.lock();
+    auto cacheblock = shard.blocks.find(blockidx);
+    if (cacheblock != shard.blocks.end())
     {
-        cachemtx.unlock();
-        return cacheblock->second;
+        CBLOCKPTR block = cacheblock->second;
+        Touch(shard, *block);
+        shard.mtx.unlock();
+        return block;
     }
-    CBLOCKPTR block(new CBlock(*this, enc, blockidx, blocksize));
-    cache[blockidx] = block;
+    CBLOCKPTR block = NewBlock(shard, blockidx);
+    shard.nmisses++;
     block->mutex.lock();
-    cachemtx.unlock();
-    if (read)
-    {
-        bio->Read(blockidx, 1, block->GetBufUnsafe());
-        if (!cryptcache)
-            enc.Decrypt(blockidx, block->GetBufUnsafe());
-    }
+    Evict(shard);
+    shard.mtx.unlock();
+    if (read) ReadBlocks(blockidx, 1, block->GetBufUnsafe(), !cryptcache);
     block->mutex.unlock();
 
     return block;
 }
 
-void CCacheIO::BlockReadForce(const int blockidx, const int n)
+// Reads n blocks from the block device. Blocks in the zero map are filled with zeros without any I/O.
+// With decrypt the blocks are returned decrypted, otherwise as stored on the device.
+void CCacheIO::ReadBlocks(const int blockidx, const int n, int8_t *d, bool decrypt)
 {
-    if (n <= 0) return;
-    auto *buf = new int8_t[blocksize*n];
-    bio->Read(blockidx, n, buf);
-    cachemtx.lock();
-    for(int i=0; i<n; i++)
+    std::vector<CReadJob> reads(1);
+    CReadJob &job = reads[0];
+    job.blockidx = blockidx;
+    job.nblocks = n;
+    job.d = d;
+    job.decrypt = decrypt;
+    PlanRead(job);
+    IssueReads(reads);
+    FinishReads(reads);
+}
+
+// Splits a job into the runs which must be read from the block device
+void CCacheIO::PlanRead(CReadJob &job)
+{
+    int8_t *d = job.d;
+    int istart = 0;
+    for(int i=0; i<=job.nblocks; i++)
     {
-        auto cacheblock = cache.find(blockidx+i);
-        assert(cacheblock != cache.end()); // block created in CacheBlocks
-        CBLOCKPTR block = cacheblock->second;
-        memcpy(block->GetBufUnsafe(), &buf[i*blocksize], blocksize);
-        if (!cryptcache)
-            enc.Decrypt(blockidx+i, block->GetBufUnsafe());
-        block->mutex.unlock();
+        bool zero = (i < job.nblocks) && IsZero(job.blockidx+i);
+        if ((i < job.nblocks) && !zero) continue;
+        if (i > istart)
+        {
+            job.runs.push_back(CReadJob::CRun{istart, i-istart, std::shared_future<void>()});
+        }
+        if (zero)
+        {
+            memset(&d[(int64_t)i*blocksize], 0, blocksize);
+            if (!job.decrypt) enc.Encrypt(job.blockidx+i, &d[(int64_t)i*blocksize]);
+        }
+        istart = i+1;
+    }
+}
+
+// Sends the runs of all jobs which are not yet in flight. Scattered runs go out as one
+// vectored read, so that they cost one command instead of one each.
+void CCacheIO::IssueReads(std::vector<CReadJob> &reads)
+{
+    std::vector<CBlockExtent> extents;
+    for(auto &job : reads)
+        for(auto &run : job.runs)
+            if (!run.done.valid())
+                extents.push_back(CBlockExtent{job.blockidx+run.first, run.n, &job.d[(int64_t)run.first*blocksize]});
+    if (extents.empty()) return;
+
+    std::shared_future<void> done;
+    if (extents.size() == 1)
+        done = bio->ReadAsync(extents[0].blockidx, extents[0].n, extents[0].d).share();
+    else
+        done = bio->ReadVAsync(extents).share();
+
+    for(auto &job : reads)
+        for(auto &run : job.runs)
+            if (!run.done.valid()) run.done = done;
+}
+
+// Waits for the reads of a job, decrypts the data, fills and unlocks its blocks
+void CCacheIO::FinishRead(CReadJob &job)
+{
+    // every read must be finished before the buffer may go away, even if one of them failed
+    std::exception_ptr error;
+    for(auto &run : job.runs)
+    {
+        try
+        {
+            run.done.get();
+        } catch(...)
+        {
+            if (!error) error = std::current_exception();
+        }
     }
-    cachemtx.unlock();
-    delete[] buf;
+    if (!error)
+    {
+        if (job.decrypt)
+            for(auto &run : job.runs)
+                enc.DecryptRange(job.blockidx+run.first, run.n, &job.d[(int64_t)run.first*blocksize]);
+        for(int i=0; i<(int)job.blocks.size(); i++)
+        {
+            assert(job.blocks[i]->blockidx == job.blockidx+i);
+            memcpy(job.blocks[i]->GetBufUnsafe(), &job.d[(int64_t)i*blocksize], blocksize);
+        }
+        if (job.decryptcopy) enc.DecryptRange(job.blockidx, job.nblocks, job.d);
+    }
+    for(auto &block : job.blocks) block->mutex.unlock();
+    job.blocks.clear();
+    job.runs.clear();
+    if (error) std::rethrow_exception(error);
+}
+
+void CCacheIO::FinishReads(std::vector<CReadJob> &reads)
+{
+    std::exception_ptr error;
+    for(auto &job : reads)
+    {
+        try
+        {
+            FinishRead(job);
+        } catch(...)
+        {
+            if (!error) error = std::current_exception();
+        }
+    }
+    reads.clear();
+    if (error) std::rethrow_exception(error);
+}
+
+// Prepares the read of the locked new blocks, which must be contiguous
+void CCacheIO::BlockReadForce(std::vector<CReadJob> &reads, const int blockidx, std::vector<CBLOCKPTR> &blocks)
+{
+    int n = blocks.size();
+    if (n <= 0) return;
+    reads.emplace_back();
+    CReadJob &job = reads.back();
+    job.blockidx = blockidx;
+    job.nblocks = n;
+    job.buf.reset(new int8_t[(int64_t)blocksize*n]);
+    job.d = job.buf.get();
+    job.blocks.swap(blocks);
+    job.decrypt = !cryptcache;
+    PlanRead(job);
 }
 
 void CCacheIO::CacheBlocks(const int blockidx, const int n)
 {
+    std::vector<CBLOCKPTR> blocks;
+    CacheBlocks(blockidx, n, blocks);
+}
+
+// Prefetched blocks are neither counted in the statistics nor moved in the lru list
+void CCacheIO::CacheBlocks(const int blockidx, const int n, std::vector<CBLOCKPTR> &blocks, bool prefetch)
+{
+    blocks.clear();
     if (n <= 0) return;
-    cachemtx.lock();
+    // the new blocks are locked and pinned until they are read. The reads of all
+    // missing runs are in flight at once
+    std::vector<CBLOCKPTR> readblocks;
+    std::vector<CReadJob> reads;
     int istart = 0;
     for(int i=0; i<n; i++)
     {
-        auto cacheblock = cache.find(blockidx+i);
-        if (cacheblock != cache.end())
+        CCacheShard &shard = GetShard(blockidx+i);
+        shard.mtx.lock();
+        auto cacheblock = shard.blocks.find(blockidx+i);
+        if (cacheblock != shard.blocks.end())
         {
-            int npart = i-istart;
-            cachemtx.unlock();
-            BlockReadForce(blockidx+istart, npart);
-            cachemtx.lock();
+            if (!prefetch) Touch(shard, *cacheblock->second);
+            blocks.push_back(cacheblock->second);
+            shard.mtx.unlock();
+            BlockReadForce(reads, blockidx+istart, readblocks);
             istart = i+1;
         } else
         {
-            CBLOCKPTR block(new CBlock(*this, enc, blockidx+i, blocksize));
-            cache[blockidx+i] = block;
+            CBLOCKPTR block = NewBlock(shard, blockidx+i);
+            if (!prefetch) shard.nmisses++;
             block->mutex.lock();
+            blocks.push_back(block);
+            readblocks.push_back(block);
+            Evict(shard);
+            shard.mtx.unlock();
+        }
+    }
+    BlockReadForce(reads, blockidx+istart, readblocks);
+    IssueReads(reads);
+    FinishReads(reads);
+}
+
+void CCacheIO::Prefetch(int64_t ofs, int64_t size)
+{
+    if (size <= 0) return;
+    int firstblock = ofs/blocksize;
+    int lastblock = (ofs+size-1)/blocksize;
+
+    std::lock_guard<std::mutex> lock(prefetchmtx);
+    if (prefetchqueue.size() >= MAXPREFETCHQUEUE) return; // we are behind anyhow
+    prefetchqueue.emplace_back(firstblock, lastblock-firstblock+1);
+    prefetchcond.notify_one();
+}
+
+void CCacheIO::Async_Prefetch()
+{
+    std::vector<CBLOCKPTR> blocks;
+    for(;;)
+    {
+        std::pair<int, int> range;
+        {
+            std::unique_lock<std::mutex> lock(prefetchmtx);
+            prefetchcond.wait(lock, [this]{ return !prefetchqueue.empty() || terminateprefetchthread; });
+            if (terminateprefetchthread) return;
+            range = prefetchqueue.front();
+            prefetchqueue.pop_front();
+        }
+        // Read in small pieces, so that a reader waiting for the first blocks is not delayed
+        for(int i=0; i<range.second; i+=MAXWRITERUN)
+        {
+            CacheBlocks(range.first+i, std::min(range.second-i, (int)MAXWRITERUN), blocks, true);
+            blocks.clear();
         }
     }
-    int npart = n-istart;
-    cachemtx.unlock();
-    BlockReadForce(blockidx+istart, npart);
 }
 
 int64_t CCacheIO::GetFilesize()
@@ -169,83 +509,576 @@ int64_t CCacheIO::GetNDirty()
 
 int64_t CCacheIO::GetNCachedBlocks()
 {
-    cachemtx.lock();
-    int64_t n = cache.size();
-    cachemtx.unlock();
+    int64_t n = 0;
+    for(auto &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        n += shard.blocks.size();
+    }
     return n;
 }
 
+int64_t CCacheIO::GetNCacheHits()
+{
+    int64_t n = 0;
+    for(auto &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        n += shard.nhits;
+    }
+    return n;
+}
+
+int64_t CCacheIO::GetNCacheMisses()
+{
+    int64_t n = 0;
+    for(auto &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        n += shard.nmisses;
+    }
+    return n;
+}
+
+int64_t CCacheIO::GetNEvictions()
+{
+    int64_t n = 0;
+    for(auto &shard : shards)
+    {
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        n += shard.nevictions;
+    }
+    return n;
+}
+
+// memory reserved for block buffers and block descriptors
+int64_t CCacheIO::GetCacheMemory()
+{
+    return bufferslab.GetReservedBytes() + blockslab.GetReservedBytes();
+}
+
+
+// -----------------------------------------------------------------
+// Writeback pipeline
+//   Async_Sync:      takes the dirty list and copies sorted runs of blocks into write jobs
+//   Async_Encrypt:   several threads encrypting the jobs in parallel
+//   Async_Submit:    hands the jobs in their original order to the block device
+// A job keeps its blocks pinned, so that they cannot be evicted and read back from the
+// block device before the new content has been written. The blocks count as dirty until then.
+
+// Waits until the pipeline has room for another job. Discard jobs need no buffer.
+CWriteJobPtr CCacheIO::GetFreeJob(bool withbuffer)
+{
+    std::unique_lock<std::mutex> lock(jobmtx);
+    jobcond.wait(lock, [this]{ return (int)submitqueue.size() < maxjobs; });
+    CWriteJobPtr job;
+    if (freejobs.empty())
+    {
+        job = std::make_shared<CWriteJob>();
+    } else
+    {
+        job = freejobs.back();
+        freejobs.pop_back();
+    }
+    // the block device may still send the old buffer
+    if (withbuffer && (!job->buf || (job->buf.use_count() > 1)))
+        job->buf = std::make_shared<std::vector<int8_t>>(blocksize*MAXWRITERUN);
+    job->direct = false;
+    job->discards.clear();
+    job->submitted = false;
+    return job;
+}
+
+void CCacheIO::QueueJob(const CWriteJobPtr &job)
+{
+    std::lock_guard<std::mutex> lock(jobmtx);
+    if (!job->encrypted) encryptqueue.push_back(job);
+    submitqueue.push_back(job);
+    job->seq = ++njobsqueued;
+    jobcond.notify_all();
+}
+
+void CCacheIO::SnapshotRun(const CBLOCKPTR *blocks, int n)
+{
+    CWriteJobPtr job;
+    int nzero = 0;
+    int ndiscarded = 0;
+    for(int i=0; i<n; i++)
+    {
+        CBlock &block = *blocks[i];
+        if (!job)
+        {
+            // backpressure. Don't copy more blocks than the pipeline can hold
+            job = GetFreeJob();
+            job->nblocks = 0;
+            job->blocks.clear();
+            // the blocks in the cache are already encrypted
+            job->encrypted = cryptcache;
+        }
+        block.mutex.lock();
+        if (block.discarded)
+        {
+            block.discarded = false;
+            block.dirty = false;
+            block.mutex.unlock();
+            ndiscarded++;
+            if (job->nblocks > 0)
+            {
+                QueueJob(job);
+                job.reset();
+            }
+            continue;
+        }
+        // Blocks which contain only zeros are not written but marked in the zero map.
+        // With cryptcache the content is not checked.
+        if (!cryptcache && InZeroMap(block.blockidx) && IsZeroBlock(block.GetBufUnsafe(), blocksize))
+        {
+            SetZero(block.blockidx, true);
+            block.dirty = false;
+            block.mutex.unlock();
+            nzero++;
+            if (job->nblocks > 0)
+            {
+                QueueJob(job);
+                job.reset();
+            }
+            continue;
+        }
+        if (job->nblocks == 0) job->blockidx = block.blockidx;
+        assert(block.blockidx == job->blockidx+job->nblocks);
+        // still pinned by the job, so the block cannot be read back before it is written
+        SetZero(block.blockidx, false);
+        memcpy(&(*job->buf)[job->nblocks*blocksize], block.GetBufUnsafe(), blocksize);
+        job->blocks.push_back(blocks[i]);
+        job->nblocks++;
+        block.dirty = false;
+        block.mutex.unlock();
+    }
+    if (job)
+    {
+        if (job->nblocks > 0)
+        {
+            QueueJob(job);
+        } else
+        {
+            std::lock_guard<std::mutex> lock(jobmtx);
+            freejobs.push_back(job);
+            jobcond.notify_all();
+        }
+    }
+    if (nzero+ndiscarded > 0)
+    {
+        nzeroblocks += nzero;
+        ndirty -= nzero+ndiscarded;
+        std::lock_guard<std::mutex> lock(dirtymtx);
+        dirtycond.notify_all();
+    }
+}
+
+void CCacheIO::Async_Encrypt()
+{
+    for(;;)
+    {
+        CWriteJobPtr job;
+        {
+            std::unique_lock<std::mutex> lock(jobmtx);
+            jobcond.wait(lock, [this]{ return !encryptqueue.empty() || terminatepipeline; });
+            if (encryptqueue.empty()) return;
+            job = encryptqueue.front();
+            encryptqueue.pop_front();
+        }
+        enc.EncryptRange(job->blockidx, job->nblocks, job->buf->data());
+
+        std::lock_guard<std::mutex> lock(jobmtx);
+        job->encrypted = true;
+        jobcond.notify_all();
+    }
+}
+
+void CCacheIO::Async_Submit()
+{
+    // The writeback rate is measured over the time the pipeline is busy
+    auto last = std::chrono::steady_clock::now();
+    bool idle = true;
+    double busy = 0.;
+    int64_t nwritten = 0;
+    for(;;)
+    {
+        std::vector<CWriteJobPtr> jobs;
+        {
+            std::unique_lock<std::mutex> lock(jobmtx);
+            jobcond.wait(lock, [this]{ return (!submitqueue.empty() && submitqueue.front()->encrypted) || (submitqueue.empty() && terminatepipeline); });
+            if (submitqueue.empty()) return;
+            // small jobs which are ready as well, like the scattered blocks of random writes.
+            // Discards are only sent together with the discards directly behind them.
+            jobs.push_back(submitqueue.front());
+            bool discard = !jobs[0]->discards.empty();
+            for(size_t i=1; (i < submitqueue.size()) && (jobs.size() < MAXVECTORJOBS); i++)
+            {
+                if (discard != !submitqueue[i]->discards.empty()) break;
+                if (!discard && ((jobs[0]->nblocks > MAXVECTORBLOCKS) || !submitqueue[i]->encrypted || (submitqueue[i]->nblocks > MAXVECTORBLOCKS))) break;
+                jobs.push_back(submitqueue[i]);
+            }
+        }
+        auto start = idle?std::chrono::steady_clock::now():last;
+        int n = 0;
+        if (!jobs[0]->discards.empty())
+        {
+            std::vector<CBlockExtent> extents;
+            for(auto &job : jobs) extents.insert(extents.end(), job->discards.begin(), job->discards.end());
+            bio->Discard(extents);
+        } else if (jobs.size() == 1)
+        {
+            bio->WriteShared(jobs[0]->blockidx, jobs[0]->nblocks, jobs[0]->buf);
+        } else
+        {
+            std::vector<CBlockExtent> extents;
+            // the buffers are shared like with WriteShared
+            for(auto &job : jobs) extents.push_back(CBlockExtent{job->blockidx, job->nblocks, job->buf->data(), job->buf});
+            bio->WriteV(extents);
+        }
+        for(auto &job : jobs)
+        {
+            n += job->nblocks;
+            job->blocks.clear();
+        }
+        ndirty -= n;
+        {
+            std::lock_guard<std::mutex> lock(dirtymtx);
+            dirtycond.notify_all();
+        }
+
+        last = std::chrono::steady_clock::now();
+        busy += std::chrono::duration<double>(last-start).count();
+        nwritten += n;
+        if (busy >= 0.1)
+        {
+            double rate = writebackrate.load();
+            rate = (rate <= 0.)?(nwritten/busy):(0.5*rate + 0.5*nwritten/busy);
+            writebackrate.store(rate);
+            busy = 0.;
+            nwritten = 0;
+        }
+
+        std::lock_guard<std::mutex> lock(jobmtx);
+        for(auto &job : jobs)
+        {
+            submitqueue.pop_front();
+            job->submitted = true;
+            // the writer of a direct job waits for it and returns it afterwards
+            if (!job->direct) freejobs.push_back(job);
+        }
+        njobssubmitted += jobs.size();
+        idle = submitqueue.empty();
+        jobcond.notify_all();
+    }
+}
 
 void CCacheIO::Async_Sync()
 {
-    int8_t buf[blocksize];
+    std::vector<CBLOCKPTR> batch;
+    int64_t generation;
     for(;;)
     {
-        while (ndirty.load() == 0)
         {
-            if (terminatesyncthread.load()) return;
+            // Below the low watermark the dirty blocks are collected for a while unless a sync is requested.
+            // Blocks which are changed again in the meantime are written only once.
             std::unique_lock<std::mutex> lock(async_sync_mutex);
-            async_sync_cond.wait(lock);
+            async_sync_cond.wait_for(lock, std::chrono::milliseconds((int)WRITEBACKDELAY), [this]{ return (syncrequested && (lastdirtyidx.load() != -1)) || (syncwanted > syncdone) || terminatesyncthread.load(); });
+            syncrequested = false;
+            generation = syncwanted;
         }
+        StoreZeroMap();
+        SnapshotDirty(batch);
+        // The snapshots change the zero map. Its blocks are written in the same round, so that
+        // a finished sync also covers the map which belongs to the data.
+        if (StoreZeroMap()) SnapshotDirty(batch);
+        SyncDone(generation);
+        if (terminatesyncthread.load() && (lastdirtyidx.load() == -1)) break;
+    }
 
-        int nextblockidx = lastdirtyidx.exchange(-1, std::memory_order_relaxed);
-        while(nextblockidx != -1)
-        {
-            cachemtx.lock();
-            CBLOCKPTR block = cache.find(nextblockidx)->second;
-            block->mutex.lock(); // TODO trylock and put back on the list
-            cachemtx.unlock();
-            nextblockidx = block->nextdirtyidx;
-            memcpy(buf, block->GetBufUnsafe(), blocksize);
-            block->nextdirtyidx = -1;
-            ndirty--;
-            block->mutex.unlock();
+    // wait until the pipeline is empty
+    std::unique_lock<std::mutex> lock(jobmtx);
+    jobcond.wait(lock, [this]{ return submitqueue.empty(); });
+}
 
-            if (!cryptcache)
-                enc.Encrypt(block->blockidx, buf);
-            bio->Write(block->blockidx, 1, buf);
-        }
+void CCacheIO::SnapshotDirty(std::vector<CBLOCKPTR> &batch)
+{
+    // Take the whole dirty list. The blocks stay marked dirty until their content is copied,
+    // so further changes don't put them on the list again but are part of this batch.
+    int nextblockidx = lastdirtyidx.exchange(-1, std::memory_order_relaxed);
+    while(nextblockidx != -1)
+    {
+        CCacheShard &shard = GetShard(nextblockidx);
+        shard.mtx.lock();
+        CBLOCKPTR block = shard.blocks.find(nextblockidx)->second;
+        shard.mtx.unlock();
+        block->mutex.lock();
+        nextblockidx = block->nextdirtyidx;
+        block->nextdirtyidx = -1;
+        block->mutex.unlock();
+        batch.push_back(block);
+    }
+
+    // write contiguous runs with one command each
+    std::sort(batch.begin(), batch.end(), [](const CBLOCKPTR &a, const CBLOCKPTR &b)
+    {
+        return a->blockidx < b->blockidx;
+    });
+    size_t istart = 0;
+    for(size_t i=1; i<=batch.size(); i++)
+    {
+        if ((i < batch.size()) && (i-istart < MAXWRITERUN) && (batch[i]->blockidx == batch[i-1]->blockidx+1)) continue;
+        SnapshotRun(&batch[istart], i-istart);
+        istart = i;
+    }
+    batch.clear();
+}
+
+
+// All blocks which were dirty when the generation was requested are queued
+void CCacheIO::SyncDone(int64_t generation)
+{
+    int64_t njobs;
+    {
+        std::lock_guard<std::mutex> lock(jobmtx);
+        njobs = njobsqueued;
     }
+    std::lock_guard<std::mutex> lock(async_sync_mutex);
+    if (generation <= syncdone) return;
+    syncdone = generation;
+    syncjobs = njobs;
+    syncdonecond.notify_all();
 }
 
+// Queued at once. The freed blocks can be allocated and written again right away,
+// and those writes, direct or from the cache, are queued behind the discard.
+// The cached copies are outdated as well. Clean blocks are dropped, dirty blocks stay on
+// the dirty list until the next snapshot, which skips them.
+void CCacheIO::Discard(int blockidx, int n)
+{
+    if (n <= 0) return;
+    std::vector<CBLOCKPTR> blocks;
+    for(int s=0; s<NSHARDS; s++)
+    {
+        CCacheShard &shard = shards[s];
+        std::lock_guard<std::mutex> lock(shard.mtx);
+        auto drop = [&](std::unordered_map<int, CBLOCKPTR>::iterator it)
+        {
+            CBlock &block = *it->second;
+            // Every user of a block holds a reference. The dirty flag is checked again below.
+            if ((it->second.use_count() == 1) && !block.dirty)
+            {
+                if (block.queue == CACHEQUEUE::A1IN) shard.a1in.erase(block.queueit); else shard.am.erase(block.queueit);
+                return shard.blocks.erase(it);
+            }
+            blocks.push_back(it->second);
+            return ++it;
+        };
+        // a large range is not looked up block by block
+        if ((size_t)n/NSHARDS > shard.blocks.size())
+        {
+            for(auto it = shard.blocks.begin(); it != shard.blocks.end();)
+            {
+                if ((it->first >= blockidx) && (it->first < blockidx+n)) it = drop(it); else ++it;
+            }
+        } else
+        {
+            for(int i = blockidx + ((s - blockidx%NSHARDS + NSHARDS) % NSHARDS); i < blockidx+n; i += NSHARDS)
+            {
+                auto it = shard.blocks.find(i);
+                if (it != shard.blocks.end()) drop(it);
+            }
+        }
+    }
+    // the block lock is not taken under the shard lock
+    for(auto &block : blocks)
+    {
+        block->mutex.lock();
+        if (block->dirty) block->discarded = true;
+        block->mutex.unlock();
+    }
+
+    CWriteJobPtr job = GetFreeJob(false);
+    job->nblocks = 0;
+    job->blocks.clear();
+    job->encrypted = true;
+    job->discards.push_back(CBlockExtent{blockidx, n, nullptr});
+    QueueJob(job);
+}
 
-void CCacheIO::Sync()
+void CCacheIO::Sync(bool wait)
 {
+    int64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(async_sync_mutex);
+        syncrequested = true;
+        generation = ++syncwanted;
+    }
     async_sync_cond.notify_one();
+    if (!wait) return;
+
+    int64_t njobs;
+    {
+        std::unique_lock<std::mutex> lock(async_sync_mutex);
+        syncdonecond.wait(lock, [&]{ return syncdone >= generation; });
+        njobs = syncjobs;
+    }
+    {
+        std::unique_lock<std::mutex> lock(jobmtx);
+        jobcond.wait(lock, [&]{ return njobssubmitted >= njobs; });
+    }
+    bio->Flush();
+}
+
+// Called by writers after they have changed n blocks. Between the watermarks the writers are slowed
+// down to the writeback rate, the more the closer they get to the high watermark. Above the high
+// watermark they wait until the writeback catches up.
+void CCacheIO::Throttle(int n)
+{
+    int64_t nd = ndirty.load();
+    if (nd < dirtylow) return;
+    Sync();
+    if (nd < dirtyhigh)
+    {
+        double rate = writebackrate.load();
+        if (rate <= 0.) return; // not measured yet
+        double pause = n/rate * (nd-dirtylow)/(double)(dirtyhigh-dirtylow);
+        std::this_thread::sleep_for(std::chrono::duration<double>(std::min(pause, 0.1)));
+        return;
+    }
+    std::unique_lock<std::mutex> lock(dirtymtx);
+    nthrottled++;
+    dirtycond.wait(lock, [this]{ return ndirty.load() < dirtyhigh; });
 }
 
 // -----------------------------------------------------------------
 
 void CCacheIO::Read(int64_t ofs, int64_t size, int8_t *d)
+{
+    if (size == 0) return;
+
+    // large reads bypass the cache for all blocks which are completely covered
+    int64_t firstfull = (ofs+blocksize-1)/blocksize;
+    int64_t lastfull = (ofs+size)/blocksize - 1;
+    if ((bypasssize <= 0) || ((lastfull-firstfull+1)*blocksize < bypasssize))
+    {
+        ReadCached(ofs, size, d);
+        return;
+    }
+    int64_t head = firstfull*blocksize - ofs;
+    int64_t tail = ofs + size - (lastfull+1)*blocksize;
+    ReadCached(ofs, head, d);
+    ReadDirect(firstfull, lastfull-firstfull+1, &d[head]);
+    ReadCached((lastfull+1)*blocksize, tail, &d[size-tail]);
+}
+
+void CCacheIO::ReadCached(int64_t ofs, int64_t size, int8_t *d)
 {
     CBLOCKPTR block;
-    int8_t *buf = nullptr;
     //printf("ReadFragment ofs=%li size=%li\n", ofs, size);
     if (size == 0) return;
 
     int firstblock = ofs/blocksize;
     int lastblock = (ofs+size-1)/blocksize;
 
-    CacheBlocks(firstblock, lastblock-firstblock+1);
+    std::vector<CBLOCKPTR> blocks;
+    CacheBlocks(firstblock, lastblock-firstblock+1, blocks);
 
     int64_t dofs = 0;
     for(int64_t j=firstblock; j<=lastblock; j++)
     {
-        //printf("GetBlock %li\n", j);
-        block = GetBlock(j, true);
+        block = blocks[j-firstblock];
         //printf("GetBuf %li\n", j);
-        buf = block->GetBufRead();
         int bsize = blocksize - (ofs%blocksize);
         bsize = std::min((int64_t)bsize, size);
-        memcpy(&d[dofs], &buf[ofs%blocksize], bsize);
+        block->ReadBuf(ofs%blocksize, bsize, &d[dofs]);
         ofs += bsize;
         dofs += bsize;
         size -= bsize;
-        block->ReleaseBuf();
     }
 }
 
+// Reads whole blocks into d. Cached blocks are copied, all others are read from the
+// block device into d and decrypted there. With bypasspopulate the read blocks are
+// added to the cache. They are locked while the read is in flight like in CacheBlocks.
+void CCacheIO::ReadDirect(const int blockidx, const int n, int8_t *d)
+{
+    std::vector<CBLOCKPTR> readblocks;
+    std::vector<CReadJob> reads;
+    std::vector<std::pair<int, CBLOCKPTR>> hits; // copied after the reads, when we hold no locks
+    int istart = 0;
+    for(int i=0; i<n; i++)
+    {
+        CCacheShard &shard = GetShard(blockidx+i);
+        shard.mtx.lock();
+        auto cacheblock = shard.blocks.find(blockidx+i);
+        if (cacheblock != shard.blocks.end())
+        {
+            CBLOCKPTR block = cacheblock->second;
+            Touch(shard, *block);
+            shard.mtx.unlock();
+            BlockReadDirect(reads, blockidx+istart, i-istart, readblocks, &d[(int64_t)istart*blocksize]);
+            hits.emplace_back(i, block);
+            istart = i+1;
+        } else
+        {
+            shard.nmisses++;
+            if (bypasspopulate)
+            {
+                CBLOCKPTR block = NewBlock(shard, blockidx+i);
+                block->mutex.lock();
+                readblocks.push_back(block);
+                Evict(shard);
+            }
+            shard.mtx.unlock();
+        }
+    }
+    BlockReadDirect(reads, blockidx+istart, n-istart, readblocks, &d[(int64_t)istart*blocksize]);
+    IssueReads(reads);
+    FinishReads(reads);
+    for(auto &hit : hits)
+        hit.second->ReadBuf(0, blocksize, &d[(int64_t)hit.first*blocksize]);
+}
+
+void CCacheIO::BlockReadDirect(std::vector<CReadJob> &reads, const int blockidx, const int n, std::vector<CBLOCKPTR> &blocks, int8_t *d)
+{
+    if (n <= 0) return;
+    assert(blocks.empty() || ((int)blocks.size() == n));
+    reads.emplace_back();
+    CReadJob &job = reads.back();
+    job.blockidx = blockidx;
+    job.nblocks = n;
+    job.d = d;
+    job.blocks.swap(blocks);
+    // the cache holds the encrypted content with cryptcache
+    job.decryptcopy = !job.blocks.empty() && cryptcache;
+    job.decrypt = !job.decryptcopy;
+    PlanRead(job);
+}
+
 void CCacheIO::Write(int64_t ofs, int64_t size, const int8_t *d)
+{
+    if (size == 0) return;
+
+    // large writes go around the cache for all blocks which are completely covered
+    int64_t firstfull = (ofs+blocksize-1)/blocksize;
+    int64_t lastfull = (ofs+size)/blocksize - 1;
+    if ((writearoundsize <= 0) || ((lastfull-firstfull+1)*blocksize < writearoundsize))
+    {
+        WriteCached(ofs, size, d);
+    } else
+    {
+        int64_t head = firstfull*blocksize - ofs;
+        int64_t tail = ofs + size - (lastfull+1)*blocksize;
+        WriteCached(ofs, head, d);
+        WriteDirect(firstfull, lastfull-firstfull+1, &d[head]);
+        WriteCached((lastfull+1)*blocksize, tail, &d[size-tail]);
+    }
+    Throttle((ofs+size-1)/blocksize - ofs/blocksize + 1);
+}
+
+void CCacheIO::WriteCached(int64_t ofs, int64_t size, const int8_t *d)
 {
     CBLOCKPTR block;
     int8_t *buf = NULL;
@@ -255,24 +1088,116 @@ void CCacheIO::Write(int64_t ofs, int64_t size, const int8_t *d)
     int firstblock = ofs/blocksize;
     int lastblock = (ofs+size-1)/blocksize;
 
-    // check which blocks we have to read
-    if ((ofs%blocksize) != 0) block = GetBlock(firstblock, true);
-    if (((ofs+size-1)%blocksize) != 0) block = GetBlock(lastblock, true);
-
     int64_t dofs = 0;
     for(int64_t j=firstblock; j<=lastblock; j++)
     {
-        block = GetBlock(j, false);
-        buf = block->GetBufReadWrite();
         int bsize = blocksize - (ofs%blocksize);
         bsize = std::min((int64_t)bsize, size);
+        // partially overwritten blocks have to be read
+        block = GetBlock(j, bsize != blocksize);
+        buf = block->GetBufReadWrite();
         memcpy(&buf[ofs%blocksize], &d[dofs], bsize);
         ofs += bsize;
         dofs += bsize;
         size -= bsize;
         block->ReleaseBuf();
     }
-    Sync();
+}
+
+// Writes whole blocks. Cached blocks are changed in the cache as usual. All other blocks are
+// encrypted from d by the writeback pipeline, which keeps them in order with the dirty blocks
+// already on their way. Blocks which were read into the cache in the meantime may hold
+// the old content and are overwritten afterwards.
+void CCacheIO::WriteDirect(const int blockidx, const int n, const int8_t *d)
+{
+    std::vector<CWriteJobPtr> jobs;
+    int istart = 0;
+    for(int i=0; i<=n; i++)
+    {
+        CBLOCKPTR block;
+        bool zero = false;
+        if (i < n)
+        {
+            CCacheShard &shard = GetShard(blockidx+i);
+            std::lock_guard<std::mutex> lock(shard.mtx);
+            auto cacheblock = shard.blocks.find(blockidx+i);
+            if (cacheblock == shard.blocks.end())
+            {
+                zero = InZeroMap(blockidx+i) && IsZeroBlock(&d[(int64_t)i*blocksize], blocksize);
+                if (zero)
+                {
+                    SetZero(blockidx+i, true);
+                    nzeroblocks++;
+                } else
+                if (i-istart < MAXWRITERUN) continue;
+            } else
+            {
+                block = cacheblock->second;
+                Touch(shard, *block);
+            }
+        }
+        if (i > istart)
+        {
+            CWriteJobPtr job = GetFreeJob();
+            job->direct = true;
+            job->blockidx = blockidx+istart;
+            job->nblocks = i-istart;
+            job->blocks.clear();
+            job->encrypted = false;
+            memcpy(job->buf->data(), &d[(int64_t)istart*blocksize], (int64_t)job->nblocks*blocksize);
+            // Cleared before the job is queued, so that a later SetZero(true) is not overwritten
+            for(int k=0; k<job->nblocks; k++) SetZero(job->blockidx+k, false);
+            // in flight like the dirty blocks
+            ndirty += job->nblocks;
+            QueueJob(job);
+            jobs.push_back(job);
+        }
+        istart = zero?(i+1):i;
+        if (block)
+        {
+            int8_t *buf = block->GetBufReadWrite();
+            memcpy(buf, &d[(int64_t)i*blocksize], blocksize);
+            block->ReleaseBuf();
+            istart = i+1;
+        }
+    }
+    if (jobs.empty()) return;
+
+    {
+        std::unique_lock<std::mutex> lock(jobmtx);
+        jobcond.wait(lock, [&jobs]
+        {
+            return std::all_of(jobs.begin(), jobs.end(), [](const CWriteJobPtr &job){ return job->submitted; });
+        });
+    }
+    for(auto &job : jobs)
+    {
+        for(int i=0; i<job->nblocks; i++)
+        {
+            int idx = job->blockidx+i;
+            CBLOCKPTR block;
+            {
+                CCacheShard &shard = GetShard(idx);
+                std::lock_guard<std::mutex> lock(shard.mtx);
+                auto cacheblock = shard.blocks.find(idx);
+                if (cacheblock == shard.blocks.end()) continue;
+                block = cacheblock->second;
+            }
+            // Waits for a read which is still in flight. Only a block which was read from the
+            // device before the job was submitted and not changed since is outdated.
+            block->mutex.lock();
+            if (!block->written && (block->loadseq < job->seq))
+            {
+                memcpy(block->GetBufUnsafe(), &d[(int64_t)(idx-blockidx)*blocksize], blocksize);
+                if (cryptcache) enc.Encrypt(idx, block->GetBufUnsafe());
+            }
+            block->mutex.unlock();
+        }
+    }
+
+    // the jobs can be reused only now that their block ranges are not needed anymore
+    std::lock_guard<std::mutex> lock(jobmtx);
+    for(auto &job : jobs) freejobs.push_back(job);
 }
 
 void CCacheIO::Zero(int64_t ofs, int64_t size)
@@ -285,22 +1210,111 @@ void CCacheIO::Zero(int64_t ofs, int64_t size)
     int firstblock = ofs/blocksize;
     int lastblock = (ofs+size-1)/blocksize;
 
-    // check which blocks we have to read
-    if ((ofs%blocksize) != 0)          block = GetBlock(firstblock, true);
-    if (((ofs+size-1)%blocksize) != 0) block = GetBlock(lastblock, true);
-
     int64_t dofs = 0;
     for(int64_t j=firstblock; j<=lastblock; j++)
     {
-        block = GetBlock(j, false);
-        buf = block->GetBufReadWrite();
         int bsize = blocksize - (ofs%blocksize);
         bsize = std::min((int64_t)bsize, size);
-        memset(&buf[ofs%blocksize], 0, bsize);
+        if ((bsize != blocksize) || !ZeroUncached(j))
+        {
+            // partially overwritten blocks have to be read
+            block = GetBlock(j, bsize != blocksize);
+            buf = block->GetBufReadWrite();
+            memset(&buf[ofs%blocksize], 0, bsize);
+            block->ReleaseBuf();
+        }
         ofs += bsize;
         dofs += bsize;
         size -= bsize;
+    }
+    Throttle(lastblock-firstblock+1);
+}
+
+// -----------------------------------------------------------------
+// Zero map. One bit per block, which is set when the block contains only zeros. The content of such
+// a block on the block device is outdated and never read. The map is stored by the filesystem
+// in the blocks given by zeromapextents and written back through the cache.
+
+void CCacheIO::AttachZeroMap(const std::vector<CBlockExtent> &mapextents, const int64_t firstblock)
+{
+    assert(zeromapbits.load() == 0);
+    for(auto &e : mapextents)
+        for(int i=0; i<e.n; i++) zeromapblocks.push_back(e.blockidx+i);
+    int64_t nmapblocks = zeromapblocks.size();
+    int64_t nwordsperblock = blocksize/8;
+    zeromap.reset(new std::atomic<uint64_t>[nmapblocks*nwordsperblock]);
+    zeromapdirty.reset(new std::atomic<bool>[nmapblocks]);
+    std::vector<uint64_t> words(nwordsperblock);
+    for(int64_t i=0; i<nmapblocks; i++)
+    {
+        CBLOCKPTR block = GetBlock(zeromapblocks[i]);
+        block->ReadBuf(0, blocksize, reinterpret_cast<int8_t*>(words.data()));
+        for(int64_t j=0; j<nwordsperblock; j++) zeromap[i*nwordsperblock+j].store(words[j]);
+        zeromapdirty[i].store(false);
+    }
+    zeromapextents = mapextents;
+    zeromapfirst = firstblock;
+    zeromapbits.store(nmapblocks*nwordsperblock*64, std::memory_order_release);
+    LOG(LogLevel::INFO) << "Cache: zero map covers " << (zeromapbits.load()*blocksize)/(1024*1024) << " MB";
+}
+
+bool CCacheIO::InZeroMap(const int64_t blockidx)
+{
+    if ((blockidx < zeromapfirst) || (blockidx >= zeromapbits.load(std::memory_order_acquire))) return false;
+    // the map does not contain itself
+    for(auto &e : zeromapextents)
+    {
+        if ((blockidx >= e.blockidx) && (blockidx < e.blockidx+e.n)) return false;
+    }
+    return true;
+}
+
+bool CCacheIO::IsZero(const int64_t blockidx)
+{
+    if (!InZeroMap(blockidx)) return false;
+    return (zeromap[blockidx/64].load(std::memory_order_relaxed) >> (blockidx%64)) & 1;
+}
+
+void CCacheIO::SetZero(const int64_t blockidx, bool zero)
+{
+    if (!InZeroMap(blockidx)) return;
+    uint64_t bit = 1ULL << (blockidx%64);
+    uint64_t old = zero?zeromap[blockidx/64].fetch_or(bit):zeromap[blockidx/64].fetch_and(~bit);
+    if (((old & bit) != 0) == zero) return;
+    zeromapdirty[(blockidx/64)/(blocksize/8)].store(true);
+}
+
+// Full blocks which are not cached are zeroed in the zero map only. The shard lock keeps
+// the block out of the cache until the bit is set.
+bool CCacheIO::ZeroUncached(const int64_t blockidx)
+{
+    if (!InZeroMap(blockidx)) return false;
+    CCacheShard &shard = GetShard(blockidx);
+    std::lock_guard<std::mutex> lock(shard.mtx);
+    if (shard.blocks.find(blockidx) != shard.blocks.end()) return false;
+    SetZero(blockidx, true);
+    nzeroblocks++;
+    return true;
+}
+
+// Copies the changed parts of the map into the cache
+// Returns whether any block of the map changed
+bool CCacheIO::StoreZeroMap()
+{
+    if (zeromapbits.load(std::memory_order_acquire) == 0) return false;
+    bool stored = false;
+    int64_t nwordsperblock = blocksize/8;
+    std::vector<uint64_t> words(nwordsperblock);
+    for(unsigned int i=0; i<zeromapblocks.size(); i++)
+    {
+        if (!zeromapdirty[i].exchange(false)) continue;
+        for(int j=0; j<nwordsperblock; j++) words[j] = zeromap[i*nwordsperblock+j].load();
+        CBLOCKPTR block = GetBlock(zeromapblocks[i], false);
+        int8_t *buf = block->GetBufReadWrite();
+        memcpy(buf, words.data(), blocksize);
         block->ReleaseBuf();
+        stored = true;
     }
-    Sync();
+    return stored;
 }
+
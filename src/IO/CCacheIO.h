@@ -1,72 +1,205 @@
 #ifndef CCACHEIO_H
 #define CCACHEIO_H
 
-#include <map>
+#include <array>
+#include <deque>
+#include <list>
 #include <vector>
 #include <mutex>
+#include <shared_mutex>
 #include <atomic>
 #include <thread>
+#include <chrono>
+#include <unordered_map>
 #include <condition_variable>
 
 #include "CBlockIO.h"
 #include "CEncrypt.h"
+#include "CSlabAllocator.h"
 
 class CCacheIO;
 
+// 2Q queues. New blocks enter A1IN. Blocks which are requested again after they have been evicted
+// from A1IN are remembered in the ghost list A1OUT and promoted to AM. So a long scan only cycles
+// through A1IN and does not flush the hot blocks in AM.
+enum class CACHEQUEUE {A1IN, AM};
+
 class CBlock
 {
     friend class CCacheIO;
 public:
-    CBlock(CCacheIO &_bio, CEncrypt &_enc, int _blockidx, int size);
-    int8_t* GetBufRead();
+    CBlock(CCacheIO &_cio, int _blockidx, int8_t *_buf);
+    ~CBlock();
     int8_t* GetBufReadWrite();
     int8_t* GetBufUnsafe();
     void ReleaseBuf();
+    void ReadBuf(int ofs, int size, int8_t *d);
 
 
 private:
     int nextdirtyidx;
+    bool dirty;
+    bool discarded; // freed while dirty. The content is not written back
+    bool written; // changed by a writer since it was loaded
+    int64_t loadseq; // number of write jobs submitted when the block was created
     int blockidx;
-    std::mutex mutex;
+    std::shared_timed_mutex mutex; // shared by readers, exclusive for writers
     CCacheIO &cio;
-    CEncrypt &enc;
-    std::vector<int8_t> buf;
-    uint32_t count;
+    int8_t *buf; // owned by the buffer slab of the cache
+
+    // protected by the mutex of the cache shard
+    CACHEQUEUE queue;
+    std::list<int>::iterator queueit;
 };
 
 using CBLOCKPTR = std::shared_ptr<CBlock>;
+// a block and the control block of its shared_ptr share one slot
+using CBlockAllocator = CSlabSTLAllocator<CBlock, sizeof(CBlock)+64>;
+
+// One stripe of the block cache. Each shard has its own lock and its own 2Q queues.
+class CCacheShard
+{
+public:
+    std::mutex mtx;
+    std::unordered_map<int, CBLOCKPTR> blocks;
+    size_t maxblocks = 0;
+    std::list<int> a1in;
+    std::list<int> am;
+    std::list<int> a1out;
+    std::unordered_map<int, std::list<int>::iterator> a1outidx;
+
+    int64_t nhits = 0;
+    int64_t nmisses = 0;
+    int64_t nevictions = 0;
+};
+
+// Contiguous run of dirty blocks on its way to the block device
+class CWriteJob
+{
+public:
+    int blockidx = 0;
+    int nblocks = 0;
+    std::vector<CBLOCKPTR> blocks; // pinned until written. Empty for direct writes
+    std::shared_ptr<std::vector<int8_t>> buf; // shared with the block device until it is sent
+    bool encrypted = false;
+    bool direct = false; // written around the cache
+    std::vector<CBlockExtent> discards; // instead of blocks
+    bool submitted = false;
+    int64_t seq = 0; // position in the submit order
+};
+using CWriteJobPtr = std::shared_ptr<CWriteJob>;
+
+// Contiguous run of blocks on its way from the block device. Several of them are
+// in flight at once. The cache blocks stay locked until the data is copied into them.
+class CReadJob
+{
+public:
+    struct CRun
+    {
+        int first; // relative to blockidx
+        int n;
+        std::shared_future<void> done; // shared by all runs issued together
+    };
+    int blockidx = 0;
+    int nblocks = 0;
+    int8_t *d = nullptr; // destination of the read
+    std::unique_ptr<int8_t[]> buf; // owns d if the data is only needed for the cache
+    std::vector<CBLOCKPTR> blocks; // empty or one per block
+    bool decrypt = false; // decrypt d on arrival
+    bool decryptcopy = false; // copy the encrypted data into the blocks and decrypt d afterwards
+    std::vector<CRun> runs; // reads issued to the block device. Blocks in the zero map need none
+};
+
+struct CCacheConfig
+{
+    int64_t maxcachesize = 256LL*1024*1024; // in bytes
+    int writebackthreads = 0; // number of encryption threads for the writeback. 0 = number of cores, at most 8
+    bool hugepages = false; // back the cache with huge pages
+    bool lockmemory = false; // keep the cache in RAM, which also keeps the decrypted blocks out of the swap
+    int64_t bypasssize = 128*1024; // reads of at least this many bytes of whole blocks bypass the cache. 0 = never
+    bool bypasspopulate = true; // add the blocks read by a bypass to the cache
+    int64_t writearoundsize = 0; // writes of at least this many bytes of whole blocks are not cached. 0 = never
+    int64_t dirtyhigh = 64LL*1024*1024; // writers wait above this amount of dirty data in bytes
+    int64_t dirtylow = 16LL*1024*1024; // writeback starts immediately above this amount of dirty data in bytes
+    int cryptthreads = 1; // number of threads which share the decryption of large contiguous reads
+};
 
 class CCacheIO
 {
     friend class CBlock;
 
 public:
-    CCacheIO(const std::shared_ptr<CAbstractBlockIO> &bio, CEncrypt &_enc, bool _cryptcache);
+    CCacheIO(const std::shared_ptr<CAbstractBlockIO> &bio, CEncrypt &_enc, bool _cryptcache, const CCacheConfig &_config = CCacheConfig());
     ~CCacheIO();
 
     void Read(int64_t ofs, int64_t size, int8_t *d);
     void Write(int64_t ofs, int64_t size, const int8_t *d);
     void Zero(int64_t ofs, int64_t size);
+    // The blocks are free and their storage on the block device is released. Asynchronous,
+    // but blocks which are written after the call keep their new content.
+    void Discard(int blockidx, int n);
 
     CBLOCKPTR GetBlock(int blockidx, bool read=true);
     //CBLOCKPTR GetWriteBlock(int blockidx);
     void CacheBlocks(int blockidx, int n);
+    void Prefetch(int64_t ofs, int64_t size); // asynchronous
+    void AttachZeroMap(const std::vector<CBlockExtent> &mapextents, int64_t firstblock);
 
     int64_t GetFilesize();
     int64_t GetNDirty();
     int64_t GetNCachedBlocks();
-    void Sync();
+    int64_t GetNCacheHits();
+    int64_t GetNCacheMisses();
+    int64_t GetNEvictions();
+    int64_t GetCacheMemory();
+    // Starts the writeback of all dirty blocks. With wait it returns when they are
+    // on stable storage.
+    void Sync(bool wait=false);
 
     int blocksize;
 
 private:
     void Async_Sync();
-    void BlockReadForce(int blockidx, int n);
+    void SyncDone(int64_t generation);
+    void SnapshotDirty(std::vector<CBLOCKPTR> &batch);
+    void Async_Encrypt();
+    void Async_Submit();
+    void SnapshotRun(const CBLOCKPTR *blocks, int n);
+    CWriteJobPtr GetFreeJob(bool withbuffer=true);
+    void QueueJob(const CWriteJobPtr &job);
+    void Async_Prefetch();
+    void Throttle(int n);
+    void ReadCached(int64_t ofs, int64_t size, int8_t *d);
+    void ReadDirect(int blockidx, int n, int8_t *d);
+    void BlockReadDirect(std::vector<CReadJob> &reads, int blockidx, int n, std::vector<CBLOCKPTR> &blocks, int8_t *d);
+    void WriteCached(int64_t ofs, int64_t size, const int8_t *d);
+    void WriteDirect(int blockidx, int n, const int8_t *d);
+    void CacheBlocks(int blockidx, int n, std::vector<CBLOCKPTR> &blocks, bool prefetch=false);
+    void BlockReadForce(std::vector<CReadJob> &reads, int blockidx, std::vector<CBLOCKPTR> &blocks);
+    void ReadBlocks(int blockidx, int n, int8_t *d, bool decrypt);
+    void PlanRead(CReadJob &job);
+    void IssueReads(std::vector<CReadJob> &reads);
+    void FinishRead(CReadJob &job);
+    void FinishReads(std::vector<CReadJob> &reads);
+    CCacheShard& GetShard(int blockidx) { return shards[blockidx % NSHARDS]; }
+    CBLOCKPTR NewBlock(CCacheShard &shard, int blockidx);
+    void Touch(CCacheShard &shard, CBlock &block);
+    bool EvictFrom(CCacheShard &shard, std::list<int> &queue);
+    void Evict(CCacheShard &shard);
     std::shared_ptr<CAbstractBlockIO> bio;
 
     CEncrypt &enc;
-    std::map<int, CBLOCKPTR> cache;
-    std::mutex cachemtx;
+    static const int NSHARDS = 64; // consecutive blocks are spread over all shards
+    static const int MAXWRITERUN = 64; // maximum number of blocks per write command
+    static const int MAXVECTORBLOCKS = 8; // jobs up to this size are submitted together as one vectored write
+    static const size_t MAXVECTORJOBS = 64;
+    static const size_t MAXPREFETCHQUEUE = 64;
+    static const size_t SLABCHUNKSIZE = 2*1024*1024;
+    static const unsigned int NSLABSTRIPES = 8; // shared by the shards, to bound the number of partly used chunks
+    // must outlive the shards. Every block is one slot in each of the slabs
+    CSlabAllocator bufferslab;
+    CSlabAllocator blockslab;
+    std::array<CCacheShard, NSHARDS> shards;
     std::atomic<int> ndirty;
     std::atomic<int> lastdirtyidx;
 
@@ -74,7 +207,60 @@ private:
     std::atomic<bool> terminatesyncthread;
     std::mutex async_sync_mutex;
     std::condition_variable async_sync_cond;
+    bool syncrequested; // protected by async_sync_mutex
+    // waiting syncs. A generation is done when its dirty blocks are queued as the first
+    // syncjobs jobs. Protected by async_sync_mutex
+    int64_t syncwanted;
+    int64_t syncdone;
+    int64_t syncjobs;
+    std::condition_variable syncdonecond;
+
+    // writeback pipeline, protected by jobmtx
+    std::vector<std::thread> encryptthreads;
+    std::thread submitthread;
+    std::mutex jobmtx;
+    std::condition_variable jobcond;
+    std::deque<CWriteJobPtr> encryptqueue;
+    std::deque<CWriteJobPtr> submitqueue;
+    std::vector<CWriteJobPtr> freejobs;
+    int maxjobs;
+    bool terminatepipeline;
+    int64_t njobsqueued; // counters of the jobs which went through the pipeline
+    std::atomic<int64_t> njobssubmitted; // also read without jobmtx
+
+    // readahead, protected by prefetchmtx
+    std::thread prefetchthread;
+    std::mutex prefetchmtx;
+    std::condition_variable prefetchcond;
+    std::deque<std::pair<int, int>> prefetchqueue; // first block and number of blocks
+    bool terminateprefetchthread;
+
+    // flow control of the dirty blocks
+    static const int WRITEBACKDELAY = 1000; // in ms. Maximum age of dirty blocks below the low watermark
+    int64_t dirtyhigh;
+    int64_t dirtylow;
+    std::mutex dirtymtx;
+    std::condition_variable dirtycond;
+    std::atomic<double> writebackrate; // blocks per second
+    std::atomic<int64_t> nthrottled;
+
+    // zero map
+    bool InZeroMap(int64_t blockidx);
+    bool IsZero(int64_t blockidx);
+    void SetZero(int64_t blockidx, bool zero);
+    bool ZeroUncached(int64_t blockidx);
+    bool StoreZeroMap();
+    std::vector<CBlockExtent> zeromapextents; // where the map is stored
+    std::vector<int> zeromapblocks; // location of each block of the map
+    int64_t zeromapfirst; // the blocks in front, which contain the filesystem tables, are not covered
+    std::atomic<int64_t> zeromapbits; // number of covered blocks. 0 if there is no map
+    std::unique_ptr<std::atomic<uint64_t>[]> zeromap;
+    std::unique_ptr<std::atomic<bool>[]> zeromapdirty; // one flag per block of the map
+    std::atomic<int64_t> nzeroblocks;
 
+    int64_t bypasssize;
+    bool bypasspopulate;
+    int64_t writearoundsize;
     bool cryptcache;
 };
 
@@ -0,0 +1,105 @@
+#include <cstring>
+#include <openssl/err.h>
+
+#include "Logger.h"
+#include "CCipher.h"
+
+void GCryptCheckError(const char *function, gpg_error_t ret);
+
+static void OpenSSLCheckError(const char *function, int ret)
+{
+    if (ret != 1)
+    {
+        char buf[256];
+        ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+        LOG(LogLevel::ERR) << function << ": Failure: " << buf;
+        throw std::exception();
+    }
+}
+
+// -----------------------------------------------------------------
+
+CCipherCBC::CCipherCBC(const uint8_t key[32])
+{
+    gpg_error_t ret = gcry_cipher_open(&hd, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CBC, 0);
+    GCryptCheckError("gcry_cipher_open", ret);
+    ret = gcry_cipher_setkey(hd, key, 32);
+    GCryptCheckError("gcry_cipher_setkey", ret);
+}
+
+CCipherCBC::~CCipherCBC()
+{
+    gcry_cipher_close(hd);
+}
+
+void CCipherCBC::Encrypt(int blockidx, int8_t *d, int size)
+{
+    int32_t iv[4];
+    iv[0] = blockidx; iv[1] = 0; iv[2] = 0; iv[3] = 0; // I know, this is bad
+    gcry_cipher_setiv (hd, iv, 16);
+    gpg_error_t ret = gcry_cipher_encrypt(hd, d, size, 0, 0);
+    GCryptCheckError("gcry_cipher_encrypt", ret);
+}
+
+void CCipherCBC::Decrypt(int blockidx, int8_t *d, int size)
+{
+    int32_t iv[4];
+    iv[0] = blockidx; iv[1] = 0; iv[2] = 0; iv[3] = 0; // I know this is bad
+    gcry_cipher_setiv (hd, iv, 16);
+    gpg_error_t ret = gcry_cipher_decrypt(hd, d, size, NULL, 0);
+    GCryptCheckError("gcry_cipher_decrypt", ret);
+}
+
+// -----------------------------------------------------------------
+
+CCipherXTS::CCipherXTS(const uint8_t key[64])
+{
+    enc = EVP_CIPHER_CTX_new();
+    dec = EVP_CIPHER_CTX_new();
+    if ((enc == nullptr) || (dec == nullptr))
+    {
+        EVP_CIPHER_CTX_free(enc);
+        EVP_CIPHER_CTX_free(dec);
+        LOG(LogLevel::ERR) << "EVP_CIPHER_CTX_new: Failure";
+        throw std::exception();
+    }
+    // the key schedule is computed once. Per block only the tweak is set
+    try
+    {
+        OpenSSLCheckError("EVP_EncryptInit_ex", EVP_EncryptInit_ex(enc, EVP_aes_256_xts(), NULL, key, NULL));
+        OpenSSLCheckError("EVP_DecryptInit_ex", EVP_DecryptInit_ex(dec, EVP_aes_256_xts(), NULL, key, NULL));
+    } catch(...)
+    {
+        EVP_CIPHER_CTX_free(enc);
+        EVP_CIPHER_CTX_free(dec);
+        throw;
+    }
+}
+
+CCipherXTS::~CCipherXTS()
+{
+    EVP_CIPHER_CTX_free(enc);
+    EVP_CIPHER_CTX_free(dec);
+}
+
+void CCipherXTS::Encrypt(int blockidx, int8_t *d, int size)
+{
+    uint8_t tweak[16];
+    memset(tweak, 0, 16);
+    uint64_t idx = static_cast<uint32_t>(blockidx);
+    for(int i=0; i<8; i++) tweak[i] = (idx >> (i*8)) & 0xFF; // little endian sector number as in IEEE 1619
+    OpenSSLCheckError("EVP_EncryptInit_ex", EVP_EncryptInit_ex(enc, NULL, NULL, NULL, tweak));
+    int len = 0;
+    OpenSSLCheckError("EVP_EncryptUpdate", EVP_EncryptUpdate(enc, (uint8_t*)d, &len, (uint8_t*)d, size));
+}
+
+void CCipherXTS::Decrypt(int blockidx, int8_t *d, int size)
+{
+    uint8_t tweak[16];
+    memset(tweak, 0, 16);
+    uint64_t idx = static_cast<uint32_t>(blockidx);
+    for(int i=0; i<8; i++) tweak[i] = (idx >> (i*8)) & 0xFF;
+    OpenSSLCheckError("EVP_DecryptInit_ex", EVP_DecryptInit_ex(dec, NULL, NULL, NULL, tweak));
+    int len = 0;
+    OpenSSLCheckError("EVP_DecryptUpdate", EVP_DecryptUpdate(dec, (uint8_t*)d, &len, (uint8_t*)d, size));
+}
@@ -0,0 +1,46 @@
+#ifndef CCIPHER_H
+#define CCIPHER_H
+
+#include <cstdint>
+#include <gcrypt.h>
+#include <openssl/evp.h>
+
+// Encrypts and decrypts whole blocks in place.
+// An instance holds the cipher state and must only be used by one thread at a time.
+class CCipher
+{
+public:
+    virtual ~CCipher() = default;
+    virtual void Encrypt(int blockidx, int8_t *d, int size) = 0;
+    virtual void Decrypt(int blockidx, int8_t *d, int size) = 0;
+};
+
+// AES-256-CBC via libgcrypt with the block index as IV. Used by filesystems of version 1.0
+class CCipherCBC : public CCipher
+{
+public:
+    explicit CCipherCBC(const uint8_t key[32]);
+    ~CCipherCBC() override;
+    void Encrypt(int blockidx, int8_t *d, int size) override;
+    void Decrypt(int blockidx, int8_t *d, int size) override;
+
+private:
+    gcry_cipher_hd_t hd;
+};
+
+// AES-256-XTS via OpenSSL with the block index as tweak. Used since version 1.1
+// OpenSSL picks AES-NI if the CPU supports it.
+class CCipherXTS : public CCipher
+{
+public:
+    explicit CCipherXTS(const uint8_t key[64]);
+    ~CCipherXTS() override;
+    void Encrypt(int blockidx, int8_t *d, int size) override;
+    void Decrypt(int blockidx, int8_t *d, int size) override;
+
+private:
+    EVP_CIPHER_CTX *enc;
+    EVP_CIPHER_CTX *dec;
+};
+
+#endif
@@ -1,5 +1,8 @@
 #include <cassert>
 #include <cstring>
+#include <atomic>
+#include <algorithm>
+#include <utility>
 #include <gcrypt.h>
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
@@ -27,6 +30,45 @@ typedef struct
 
 } TEncHeader;
 
+static std::atomic<uint64_t> nextid(1);
+
+// below this number of blocks per thread a range is not split
+static const int MINBLOCKSPERTHREAD = 16;
+
+// Owns the cipher handles of one CEncrypt instance. The number of handles is bounded by
+// the number of threads which use the instance at the same time.
+struct CCipherPool
+{
+    std::mutex mtx;
+    std::vector<std::unique_ptr<CCipher>> handles;
+    std::vector<CCipher*> idle;
+};
+
+// cipher handles borrowed by this thread, one per CEncrypt instance.
+// They are given back to their pool when the thread exits.
+struct CThreadHandles
+{
+    struct CEntry
+    {
+        uint64_t id;
+        std::weak_ptr<CCipherPool> pool;
+        CCipher *hd;
+    };
+    std::vector<CEntry> entries;
+
+    ~CThreadHandles()
+    {
+        for(auto &e : entries)
+        {
+            std::shared_ptr<CCipherPool> pool = e.pool.lock();
+            if (!pool) continue;
+            std::lock_guard<std::mutex> lock(pool->mtx);
+            pool->idle.push_back(e.hd);
+        }
+    }
+};
+static thread_local CThreadHandles threadhandles;
+
 void GCryptCheckError(const char *function, gpg_error_t ret)
 {
     if (ret)
@@ -58,7 +100,7 @@ void CEncrypt::CreateEnc(int8_t *block, char *pass)
     auto *h = (TEncHeader*)block;
     memset(h, 0, sizeof(blocksize));
     h->majorversion = 1;
-    h->minorversion = 0;
+    h->minorversion = CIPHER_XTS;
     strcpy(h->magic, "coverfs");
 
     gcry_create_nonce (h->salt, 32);
@@ -88,7 +130,7 @@ void CEncrypt::CreateEnc(int8_t *block, char *pass)
     gcry_md_hash_buffer(GCRY_MD_CRC32, &h->crc, (int8_t*)h+4, blocksize-4);
 }
 
-CEncrypt::CEncrypt(CAbstractBlockIO &bio, char *pass)
+CEncrypt::CEncrypt(CAbstractBlockIO &bio, char *pass, int nthreads) : pool(std::make_shared<CCipherPool>()), terminateworkers(false)
 {
     static_assert(sizeof(TEncHeader) == 4+8+4+32+(128+64+64+64+4)*4, "");
     assert(bio.blocksize >= 1024);
@@ -121,7 +163,13 @@ CEncrypt::CEncrypt(CAbstractBlockIO &bio, char *pass)
     gcry_md_hash_buffer(GCRY_MD_CRC32, &crc, (int8_t*)h+4, blocksize-4);
     assert(h->crc == crc);
     assert(h->majorversion == 1);
-    assert(h->minorversion == 0);
+    if ((h->minorversion != CIPHER_CBC) && (h->minorversion != CIPHER_XTS))
+    {
+        LOG(LogLevel::ERR) << "Unknown encryption version " << h->majorversion << "." << h->minorversion;
+        throw std::exception();
+    }
+    cipher = h->minorversion;
+    LOG(LogLevel::INFO) << "Block cipher: " << ((cipher == CIPHER_XTS)?"AES-256-XTS":"AES-256-CBC");
 
     uint8_t passkey[64];
     PassToHash(pass, h->salt, passkey, static_cast<unsigned long>(h->user[0].hashreps));
@@ -145,64 +193,166 @@ CEncrypt::CEncrypt(CAbstractBlockIO &bio, char *pass)
     GCryptCheckError("gcry_cipher_decrypt", ret);
     gcry_cipher_close(hd);
 
-    for (auto &i : hdblock) {
-        ret =  gcry_cipher_open(&i, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_CBC, 0);
-        GCryptCheckError("gcry_cipher_open", ret);
-        ret = gcry_cipher_setkey(i, key, 32);
-        GCryptCheckError("gcry_cipher_setkey", ret);
-    }
+    memcpy(this->key, key, 64);
+    id = nextid++;
 
     memset(key, 0, 64);
     memset(block, 0, blocksize);
+
+    for(int i=1; i<nthreads; i++)
+        workers.emplace_back(&CEncrypt::Async_Crypt, this);
 }
 
-void CEncrypt::Decrypt(const int blockidx, int8_t *d)
+CEncrypt::~CEncrypt()
 {
-    //printf("Decrypt blockidx %i\n", blockidx);
-    int32_t iv[4];
-    iv[0] = blockidx; iv[1] = 0; iv[2] = 0; iv[3] = 0; // I know this is bad
+    {
+        std::lock_guard<std::mutex> lock(poolmtx);
+        terminateworkers = true;
+        poolcond.notify_all();
+    }
+    for(auto &w : workers) w.join();
 
-    if (blockidx == 0) return;
+    // Handles still borrowed by other threads are keyed by the id, which is never reused.
+    // Those threads find the pool gone when they exit.
+    pool.reset();
+    memset(key, 0, 64);
+}
+
+CCipher* CEncrypt::GetHandle()
+{
+    std::vector<CThreadHandles::CEntry> &entries = threadhandles.entries;
+    for(auto &e : entries)
+        if (e.id == id) return e.hd;
 
-    for(int i=0; i<4; i++)
+    // forget the handles of destroyed instances
+    entries.erase(std::remove_if(entries.begin(), entries.end(), [](const CThreadHandles::CEntry &e)
     {
-        if (!mutex[i].try_lock()) continue;
-        gcry_cipher_setiv (hdblock[i], iv, 16);
-        gpg_error_t ret = gcry_cipher_decrypt(hdblock[i], d, blocksize, NULL, 0);
-        GCryptCheckError("gcry_cipher_decrypt", ret);
-        mutex[i].unlock();
-        return;
+        return e.pool.expired();
+    }), entries.end());
+
+    CCipher *hd = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(pool->mtx);
+        if (!pool->idle.empty())
+        {
+            hd = pool->idle.back();
+            pool->idle.pop_back();
+        }
     }
+    if (hd == nullptr)
+    {
+        std::unique_ptr<CCipher> c;
+        if (cipher == CIPHER_XTS)
+            c.reset(new CCipherXTS(key));
+        else
+            c.reset(new CCipherCBC(key));
+        hd = c.get();
+        std::lock_guard<std::mutex> lock(pool->mtx);
+        pool->handles.push_back(std::move(c));
+    }
+    entries.push_back({id, pool, hd});
+    return hd;
+}
 
-    // all cipher handles are locked. Wait ...
-    mutex[0].lock();
-    gcry_cipher_setiv (hdblock[0], iv, 16);
-    gpg_error_t ret = gcry_cipher_decrypt(hdblock[0], d, blocksize, NULL, 0);
-    GCryptCheckError("gcry_cipher_decrypt", ret);
-    mutex[0].unlock();
+void CEncrypt::Decrypt(const int blockidx, int8_t *d)
+{
+    //printf("Decrypt blockidx %i\n", blockidx);
+    if (blockidx == 0) return;
+    GetHandle()->Decrypt(blockidx, d, blocksize);
 }
 
 void CEncrypt::Encrypt(const int blockidx, int8_t* d)
 {
     //printf("Encrypt blockidx %i\n", blockidx);
-    int32_t iv[4];
-    iv[0] = blockidx; iv[1] = 0; iv[2] = 0; iv[3] = 0; // I know, this is bad
     if (blockidx == 0) return;
+    GetHandle()->Encrypt(blockidx, d, blocksize);
+}
+
+void CEncrypt::DecryptRange(const int firstblock, const int n, int8_t *d)
+{
+    CryptRange(false, firstblock, n, d);
+}
 
-    for(int i=0; i<4; i++)
+void CEncrypt::EncryptRange(const int firstblock, const int n, int8_t *d)
+{
+    CryptRange(true, firstblock, n, d);
+}
+
+// The key schedule of the handle is set up once per thread. Every block is its own cipher unit
+// with its index as IV or tweak, so a run cannot be one engine call without changing the format.
+void CEncrypt::CryptRun(bool encrypt, const int firstblock, const int n, int8_t *d)
+{
+    CCipher *hd = GetHandle();
+    for(int i=0; i<n; i++)
     {
-        if (!mutex[i].try_lock()) continue;
-        gcry_cipher_setiv (hdblock[i], iv, 16);
-        gpg_error_t ret = gcry_cipher_encrypt(hdblock[i], d, blocksize, 0, 0);
-        GCryptCheckError("gcry_cipher_encrypt", ret);
-        mutex[i].unlock();
+        if (firstblock+i == 0) continue;
+        if (encrypt)
+            hd->Encrypt(firstblock+i, &d[(int64_t)i*blocksize], blocksize);
+        else
+            hd->Decrypt(firstblock+i, &d[(int64_t)i*blocksize], blocksize);
+    }
+}
+
+void CEncrypt::CryptRange(bool encrypt, const int firstblock, const int n, int8_t *d)
+{
+    int nparts = std::min((int)workers.size()+1, n/MINBLOCKSPERTHREAD);
+    if (nparts <= 1)
+    {
+        CryptRun(encrypt, firstblock, n, d);
         return;
     }
 
-    // all cipher handles are locked. Wait ...
-    mutex[1].lock();
-    gcry_cipher_setiv (hdblock[1], iv, 16);
-    gpg_error_t ret = gcry_cipher_encrypt(hdblock[1], d, blocksize, 0, 0);
-    GCryptCheckError("gcry_cipher_encrypt", ret);
-    mutex[1].unlock();
+    int npart = (n+nparts-1)/nparts;
+    int pending = 0;
+    bool failed = false;
+    {
+        std::lock_guard<std::mutex> lock(poolmtx);
+        for(int start=npart; start<n; start+=npart)
+        {
+            tasks.push_back(CCryptTask{encrypt, firstblock+start, std::min(npart, n-start), &d[(int64_t)start*blocksize], &pending, &failed});
+            pending++;
+        }
+        poolcond.notify_all();
+    }
+
+    // the tasks point to this stack frame, so wait for them even if our own part fails
+    bool ownfailed = false;
+    try
+    {
+        CryptRun(encrypt, firstblock, npart, d);
+    } catch(...)
+    {
+        ownfailed = true;
+    }
+
+    std::unique_lock<std::mutex> lock(poolmtx);
+    donecond.wait(lock, [&pending]{ return pending == 0; });
+    if (failed || ownfailed) throw std::exception();
+}
+
+void CEncrypt::Async_Crypt()
+{
+    for(;;)
+    {
+        CCryptTask task;
+        {
+            std::unique_lock<std::mutex> lock(poolmtx);
+            poolcond.wait(lock, [this]{ return !tasks.empty() || terminateworkers; });
+            if (tasks.empty()) return;
+            task = tasks.front();
+            tasks.pop_front();
+        }
+        bool failed = false;
+        try
+        {
+            CryptRun(task.encrypt, task.firstblock, task.n, task.d);
+        } catch(...)
+        {
+            failed = true;
+        }
+
+        std::lock_guard<std::mutex> lock(poolmtx);
+        if (failed) *task.failed = true;
+        if (--(*task.pending) == 0) donecond.notify_all();
+    }
 }
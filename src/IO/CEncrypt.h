@@ -4,21 +4,67 @@
 #include <gcrypt.h>
 
 #include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <vector>
+#include <memory>
 #include "CBlockIO.h"
+#include "CCipher.h"
+
+struct CCipherPool;
 
 class CEncrypt
 {
 public:
-    CEncrypt(CAbstractBlockIO &_bio, char* pass);
+    CEncrypt(CAbstractBlockIO &_bio, char* pass, int nthreads = 1);
+    ~CEncrypt();
     void PassToHash(char* pass, uint8_t salt[32], uint8_t passkey[32], unsigned long hashreps);
     void Decrypt(int blockidx, int8_t *d);
     void Encrypt(int blockidx, int8_t* d);
+
+    // n contiguous blocks in one buffer. Large runs are split among the worker threads
+    void DecryptRange(int firstblock, int n, int8_t *d);
+    void EncryptRange(int firstblock, int n, int8_t *d);
     void CreateEnc(int8_t* block, char *pass);
 
+    // the cipher engine is selected by the minor version of the encryption header
+    // 0: AES-256-CBC, 1: AES-256-XTS
+    static const int CIPHER_CBC = 0;
+    static const int CIPHER_XTS = 1;
+    int GetCipher() const { return cipher; }
+
 private:
+    struct CCryptTask
+    {
+        bool encrypt;
+        int firstblock;
+        int n;
+        int8_t *d;
+        int *pending; // parts of the range not finished yet, protected by poolmtx
+        bool *failed;
+    };
+
+    CCipher* GetHandle();
+    void CryptRange(bool encrypt, int firstblock, int n, int8_t *d);
+    void CryptRun(bool encrypt, int firstblock, int n, int8_t *d);
+    void Async_Crypt();
+
     int blocksize;
-    gcry_cipher_hd_t hdblock[4]; // for multi-threading support we need several cipher handles
-    std::mutex mutex[4];
+    int cipher;
+    uint64_t id; // unique per instance, identifies the thread-local cipher handles
+    uint8_t key[64];
+
+    // every thread borrows its own cipher handle on first use and returns it when it exits
+    std::shared_ptr<CCipherPool> pool;
+
+    // helpers for DecryptRange and EncryptRange. The calling thread does one part itself
+    std::vector<std::thread> workers;
+    std::mutex poolmtx;
+    std::condition_variable poolcond;
+    std::condition_variable donecond;
+    std::deque<CCryptTask> tasks;
+    bool terminateworkers;
 };
 
 
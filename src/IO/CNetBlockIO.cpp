@@ -1,14 +1,15 @@
 #include"Logger.h"
 #include"CNetBlockIO.h"
 #include"CNetReadWriteBuffer.h"
+#include"NetProtocol.h"
 
 #include<iostream>
+#include<algorithm>
+#include<future>
 #include<memory>
 
 using boost::asio::ip::tcp;
 
-enum class COMMAND : int32_t {READ=0, WRITE=1, SIZE=2, CONTAINERINFO=3, CLOSE=4};
-
 typedef struct
 {
     int32_t cmd;
@@ -18,6 +19,18 @@ typedef struct
     int64_t data;
 } CommandDesc;
 
+// Vectored command for one connection. The header lists the extents as offset and length
+// pairs. Their data follows the header for WRITEV and forms the reply of READV.
+class CVectorCommand
+{
+public:
+    int connection;
+    std::vector<int64_t> extents;
+    CBufferList buffers;
+    std::vector<std::shared_ptr<const int8_t>> owners; // per buffer. Empty if it must be copied
+    int64_t length = 0;
+};
+
 template <typename E>
 constexpr auto to_underlying(E e) noexcept
 {
@@ -43,11 +56,10 @@ bool verify_certificate(bool preverified, boost::asio::ssl::verify_context& ctx)
 }
 
 
-CNetBlockIO::CNetBlockIO(int _blocksize, const std::string &host, const std::string &port)
+CNetBlockIO::CNetBlockIO(int _blocksize, const std::string &host, const std::string &port, const CNetConfig &config)
 : CAbstractBlockIO(_blocksize),
   ctx(io_service, ssl::context::sslv23),
   sctrl(io_service, ctx),
-  sdata(io_service, ctx),
   cmdid(0)
 {
     static_assert(sizeof(CommandDesc) == 32, "");
@@ -63,11 +75,15 @@ CNetBlockIO::CNetBlockIO(int _blocksize, const std::string &host, const std::str
         throw std::exception();
     }
 
-    sctrl.set_verify_mode(boost::asio::ssl::verify_peer);
-    sctrl.set_verify_callback(verify_certificate);
-
-    sdata.set_verify_mode(boost::asio::ssl::verify_peer);
-    sdata.set_verify_callback(verify_certificate);
+    int nconnections = std::max(config.nconnections, 1);
+    int niothreads = std::min(std::max(config.niothreads, 1), nconnections);
+    for(int i=1; i<niothreads; i++)
+        dataservices.push_back(std::make_unique<boost::asio::io_service>());
+    for(int i=0; i<nconnections; i++)
+    {
+        boost::asio::io_service &service = ((i%niothreads) == 0)?io_service:*dataservices[i%niothreads-1];
+        sdata.push_back(std::make_unique<ssl_socket>(service, ctx));
+    }
 
     tcp::resolver resolver(io_service);
     tcp::resolver::query q(host, port);
@@ -80,21 +96,9 @@ CNetBlockIO::CNetBlockIO(int _blocksize, const std::string &host, const std::str
     }
     LOG(LogLevel::INFO) << "Connect to " << host;
 
-    boost::asio::connect(sctrl.lowest_layer(), iter, ec);
-    if (ec)
-    {
-        LOG(LogLevel::ERR) << "Cannot connect to server. (Control Stream)\n";
-        throw std::exception();
-    }
-    sctrl.handshake(boost::asio::ssl::stream_base::client);
-
-    boost::asio::connect(sdata.lowest_layer(), iter, ec);
-    if (ec)
-    {
-        LOG(LogLevel::ERR) << "Cannot connect to server. (Data Stream)";
-        throw std::exception();
-    }
-    sdata.handshake(boost::asio::ssl::stream_base::client);
+    Connect(sctrl, iter, "Control Stream");
+    for(auto &s : sdata) Connect(*s, iter, "Data Stream");
+    LOG(LogLevel::INFO) << "Connected with " << nconnections << " data streams";
 
 #ifdef __linux__
     int priority = 6;
@@ -105,17 +109,37 @@ CNetBlockIO::CNetBlockIO(int _blocksize, const std::string &host, const std::str
     }
 #endif
 
-    rbbufctrl = std::make_unique<CNetReadWriteBuffer>(sctrl);
-    rbbufdata = std::make_unique<CNetReadWriteBuffer>(sdata);
+    rbbufctrl = std::make_unique<CNetReadWriteBuffer>(sctrl, config.ringsize, config.maxringsize);
+    for(auto &s : sdata)
+        rbbufdata.push_back(std::make_unique<CNetReadWriteBuffer>(*s, config.ringsize, config.maxringsize));
 
-    iothread = std::thread([&](){
-        work = std::make_unique<boost::asio::io_service::work>(io_service);
-        io_service.run();
-    });
+    works.push_back(std::make_unique<boost::asio::io_service::work>(io_service));
+    iothreads.emplace_back([this](){ io_service.run(); });
+    for(auto &service : dataservices)
+    {
+        boost::asio::io_service *s = service.get();
+        works.push_back(std::make_unique<boost::asio::io_service::work>(*s));
+        iothreads.emplace_back([s](){ s->run(); });
+    }
 
     GetInfo();
 }
 
+void CNetBlockIO::Connect(ssl_socket &s, tcp::resolver::iterator iter, const char *name)
+{
+    s.set_verify_mode(boost::asio::ssl::verify_peer);
+    s.set_verify_callback(verify_certificate);
+
+    boost::system::error_code ec;
+    boost::asio::connect(s.lowest_layer(), iter, ec);
+    if (ec)
+    {
+        LOG(LogLevel::ERR) << "Cannot connect to server. (" << name << ")";
+        throw std::exception();
+    }
+    s.handshake(boost::asio::ssl::stream_base::client);
+}
+
 CNetBlockIO::~CNetBlockIO()
 {
 
@@ -125,15 +149,16 @@ CNetBlockIO::~CNetBlockIO()
     LOG(LogLevel::DEBUG) << "CNetBlockIO: Send Close command done";
 
     rbbufctrl->Sync();
-    rbbufdata->Sync();
+    for(auto &rb : rbbufdata) rb->Sync();
 
-    work.reset();
+    works.clear();
     io_service.stop();
-    iothread.join();
+    for(auto &service : dataservices) service->stop();
+    for(auto &t : iothreads) t.join();
 
     LOG(LogLevel::DEBUG) << "CNetBlockIO: Destruct buffer";
     rbbufctrl.reset();
-    rbbufdata.reset();
+    rbbufdata.clear();
     LOG(LogLevel::DEBUG) << "CNetBlockIO: Destruct buffers done";
 
     LOG(LogLevel::DEBUG) << "CNetBlockIO: Destruct done";
@@ -141,7 +166,9 @@ CNetBlockIO::~CNetBlockIO()
 
 int64_t CNetBlockIO::GetWriteCache()
 {
-    return rbbufctrl->GetBytesInCache() + rbbufdata->GetBytesInCache();
+    int64_t n = rbbufctrl->GetBytesInCache();
+    for(auto &rb : rbbufdata) n += rb->GetBytesInCache();
+    return n;
 }
 
 int64_t CNetBlockIO::GetFilesize()
@@ -168,7 +195,18 @@ void CNetBlockIO::GetInfo()
     std::future<void> fut = rbbufctrl->Read(id, data, 36);
     rbbufctrl->Write(id, (int8_t*)&cmd, 4);
     fut.get();
+    data[31] = 0;
     LOG(LogLevel::INFO) << "Connected to '" << data << "'";
+    // older servers leave the flags zero
+    int32_t capabilities;
+    memcpy(&capabilities, &data[32], 4);
+    vectored = (capabilities & CAPABILITY_VECTORED) != 0;
+    flushable = (capabilities & CAPABILITY_FLUSH) != 0;
+    discardable = (capabilities & CAPABILITY_DISCARD) != 0;
+    if (!flushable)
+    {
+        LOG(LogLevel::WARN) << "Server cannot flush. Written data may not be durable";
+    }
 }
 
 
@@ -178,38 +216,268 @@ void CNetBlockIO::Close()
     int8_t data[8];
     int32_t id = cmdid.fetch_add(1);
     cmd.cmd = to_underlying(COMMAND::CLOSE);
-    std::future<void> futctrl = rbbufctrl->Read(id, data, 0);
-    std::future<void> futdata = rbbufdata->Read(id, data, 0);
+    std::vector<std::future<void>> futs;
+    futs.push_back(rbbufctrl->Read(id, data, 0));
+    for(auto &rb : rbbufdata) futs.push_back(rb->Read(id, data, 0));
     rbbufctrl->Write(id, (int8_t*)&cmd, 4);
-    rbbufdata->Write(id, (int8_t*)&cmd, 4);
-    futctrl.get();
-    futdata.get();
+    for(auto &rb : rbbufdata) rb->Write(id, (int8_t*)&cmd, 4);
+    for(auto &fut : futs) fut.get();
 }
 
 
-void CNetBlockIO::Read(const int blockidx, const int n, int8_t *d)
+// The writes are sent through the data connections. Each connection is processed in order,
+// so the flush on every one of them covers all writes before.
+void CNetBlockIO::Flush()
 {
+    if (!flushable) return;
     CommandDesc cmd{};
+    int8_t data[8];
     int32_t id = cmdid.fetch_add(1);
-    cmd.cmd = to_underlying(COMMAND::READ);
-    cmd.dummy = 0;
-    cmd.offset = blockidx*blocksize;
-    cmd.length = blocksize*n;
-    //printf("read block %i\n", blockidx);
-    std::future<void> fut = rbbufctrl->Read(id, d, blocksize*n);
-    rbbufctrl->Write(id, (int8_t*)&cmd, 2*4+2*8);
-    fut.get();
+    cmd.cmd = to_underlying(COMMAND::FLUSH);
+    std::vector<std::future<void>> futs;
+    for(auto &rb : rbbufdata) futs.push_back(rb->Read(id, data, 0));
+    for(auto &rb : rbbufdata) rb->Write(id, (int8_t*)&cmd, 4);
+    for(auto &fut : futs) fut.get();
+}
+
+
+// Like a vectored write without data and without a reply. Every stripe goes through its
+// own connection, so the discard stays in order with the writes to the same blocks.
+void CNetBlockIO::Discard(const std::vector<CBlockExtent> &extents)
+{
+    if (!discardable) return;
+    std::vector<std::vector<int64_t>> tables(rbbufdata.size()); // offset and length pairs
+    auto send = [this](int c, std::vector<int64_t> &table)
+    {
+        CommandDesc cmd{};
+        cmd.cmd = to_underlying(COMMAND::DISCARD);
+        cmd.dummy = table.size()/2;
+        std::vector<int8_t> header(2*4+2*8 + table.size()*8);
+        memcpy(header.data(), &cmd, 2*4+2*8);
+        memcpy(&header[2*4+2*8], table.data(), table.size()*8);
+        rbbufdata[c]->Write(cmdid.fetch_add(1), header.data(), header.size());
+        table.clear();
+    };
+
+    for(auto &e : extents)
+    {
+        for(int i=0; i<e.n;)
+        {
+            int ni = std::min(e.n-i, STRIPEBLOCKS - (e.blockidx+i)%STRIPEBLOCKS);
+            int c = GetConnection(e.blockidx+i);
+            int64_t offset = (int64_t)(e.blockidx+i)*blocksize;
+            int64_t length = (int64_t)ni*blocksize;
+            i += ni;
+            std::vector<int64_t> &table = tables[c];
+            // with a single connection the stripes are contiguous
+            if (!table.empty() && (table[table.size()-2]+table.back() == offset))
+            {
+                table.back() += length;
+                continue;
+            }
+            if (table.size()/2 >= MAXEXTENTS) send(c, table);
+            table.push_back(offset);
+            table.push_back(length);
+        }
+    }
+    for(size_t c=0; c<tables.size(); c++)
+    {
+        if (!tables[c].empty()) send(c, tables[c]);
+    }
+}
+
+
+// ready when all parts are. Waits in the thread which calls get().
+// The other connections may still receive into the buffer, so a failed part is
+// reported only after every part has finished.
+static std::future<void> WhenAll(std::vector<std::future<void>> futs)
+{
+    if (futs.size() == 1) return std::move(futs[0]);
+    return std::async(std::launch::deferred, [](std::vector<std::future<void>> futs)
+    {
+        std::exception_ptr error;
+        for(auto &fut : futs)
+        {
+            try
+            {
+                fut.get();
+            } catch(...)
+            {
+                if (!error) error = std::current_exception();
+            }
+        }
+        if (error) std::rethrow_exception(error);
+    }, std::move(futs));
 }
 
+void CNetBlockIO::Read(const int blockidx, const int n, int8_t *d)
+{
+    ReadAsync(blockidx, n, d).get();
+}
+
+// The answers are matched to the requests by the command id, so any number of reads can be in flight.
+// Reads go through the data stream of their stripe: the server processes each stream in order, so
+// a read cannot overtake a write of the same blocks which was sent before.
+std::future<void> CNetBlockIO::ReadAsync(const int blockidx, const int n, int8_t *d)
+{
+    std::vector<std::future<void>> futs;
+    for(int i=0; i<n;)
+    {
+        int ni = std::min(n-i, STRIPEBLOCKS - (blockidx+i)%STRIPEBLOCKS);
+        CNetReadWriteBuffer &rb = *rbbufdata[GetConnection(blockidx+i)];
+        CommandDesc cmd{};
+        int32_t id = cmdid.fetch_add(1);
+        cmd.cmd = to_underlying(COMMAND::READ);
+        cmd.dummy = 0;
+        cmd.offset = (int64_t)(blockidx+i)*blocksize;
+        cmd.length = blocksize*ni;
+        //printf("read block %i\n", blockidx);
+        futs.push_back(rb.Read(id, &d[(int64_t)i*blocksize], blocksize*ni));
+        rb.Write(id, (int8_t*)&cmd, 2*4+2*8);
+        i += ni;
+    }
+    return WhenAll(std::move(futs));
+}
+
+// The command header and the payload are framed separately, so the payload is not copied
+// onto the stack first
 void CNetBlockIO::Write(const int blockidx, const int n, int8_t* d)
 {
-    int8_t buf[blocksize*n + 2*8 + 2*4];
-    auto *cmd = (CommandDesc*)buf;
-    int32_t id = cmdid.fetch_add(1);
-    cmd->cmd = to_underlying(COMMAND::WRITE);
-    cmd->dummy = 0;
-    cmd->offset = blockidx*blocksize;
-    cmd->length = blocksize*n;
-    memcpy(&cmd->data, d, blocksize*n);
-    rbbufdata->Write(id, buf, blocksize*n + 2*8 + 2*4);
+    for(int i=0; i<n;)
+    {
+        int ni = std::min(n-i, STRIPEBLOCKS - (blockidx+i)%STRIPEBLOCKS);
+        CommandDesc cmd{};
+        int32_t id = cmdid.fetch_add(1);
+        cmd.cmd = to_underlying(COMMAND::WRITE);
+        cmd.dummy = 0;
+        cmd.offset = (int64_t)(blockidx+i)*blocksize;
+        cmd.length = blocksize*ni;
+        rbbufdata[GetConnection(blockidx+i)]->Write(id, (int8_t*)&cmd, 2*4+2*8, &d[(int64_t)i*blocksize], blocksize*ni);
+        i += ni;
+    }
+}
+
+// Sent directly from d without any copy
+void CNetBlockIO::WriteShared(const int blockidx, const int n, const std::shared_ptr<const std::vector<int8_t>> &d)
+{
+    for(int i=0; i<n;)
+    {
+        int ni = std::min(n-i, STRIPEBLOCKS - (blockidx+i)%STRIPEBLOCKS);
+        CommandDesc cmd{};
+        int32_t id = cmdid.fetch_add(1);
+        cmd.cmd = to_underlying(COMMAND::WRITE);
+        cmd.dummy = 0;
+        cmd.offset = (int64_t)(blockidx+i)*blocksize;
+        cmd.length = blocksize*ni;
+        std::shared_ptr<const int8_t> payload(d, d->data()+(int64_t)i*blocksize);
+        rbbufdata[GetConnection(blockidx+i)]->Write(id, (int8_t*)&cmd, 2*4+2*8, payload, blocksize*ni);
+        i += ni;
+    }
+}
+
+// Splits the extents at the stripe boundaries and packs them into one command per connection,
+// or more if they get too large. The extents of each connection keep their order.
+void CNetBlockIO::BuildVectorCommands(const std::vector<CBlockExtent> &extents, std::vector<CVectorCommand> &commands)
+{
+    std::vector<int> current(rbbufdata.size(), -1); // command which is filled for each connection
+    for(auto &e : extents)
+    {
+        for(int i=0; i<e.n;)
+        {
+            int ni = std::min(e.n-i, STRIPEBLOCKS - (e.blockidx+i)%STRIPEBLOCKS);
+            int c = GetConnection(e.blockidx+i);
+            int64_t offset = (int64_t)(e.blockidx+i)*blocksize;
+            int64_t length = (int64_t)ni*blocksize;
+            int8_t *d = &e.d[(int64_t)i*blocksize];
+            i += ni;
+
+            if ((current[c] < 0)
+                || (commands[current[c]].buffers.size() >= MAXEXTENTS)
+                || (commands[current[c]].length+length > MAXVECTORBYTES))
+            {
+                current[c] = commands.size();
+                commands.emplace_back();
+                commands.back().connection = c;
+            }
+            CVectorCommand &vc = commands[current[c]];
+            vc.length += length;
+            // continues the previous extent on the device and in memory, with the same owner
+            if (!vc.buffers.empty()
+                && (vc.extents[vc.extents.size()-2]+vc.extents.back() == offset)
+                && (vc.buffers.back().first+vc.buffers.back().second == d)
+                && !vc.owners.back().owner_before(e.owner) && !e.owner.owner_before(vc.owners.back()))
+            {
+                vc.extents.back() += length;
+                vc.buffers.back().second += length;
+                continue;
+            }
+            vc.extents.push_back(offset);
+            vc.extents.push_back(length);
+            vc.buffers.emplace_back(d, length);
+            vc.owners.push_back(e.owner?std::shared_ptr<const int8_t>(e.owner, d):nullptr);
+        }
+    }
+}
+
+static std::vector<int8_t> VectorHeader(COMMAND command, const CVectorCommand &vc)
+{
+    CommandDesc cmd{};
+    cmd.cmd = to_underlying(command);
+    cmd.dummy = vc.buffers.size();
+    cmd.offset = 0;
+    cmd.length = vc.length;
+    std::vector<int8_t> header(2*4+2*8 + vc.extents.size()*8);
+    memcpy(header.data(), &cmd, 2*4+2*8);
+    memcpy(&header[2*4+2*8], vc.extents.data(), vc.extents.size()*8);
+    return header;
+}
+
+void CNetBlockIO::ReadV(const std::vector<CBlockExtent> &extents)
+{
+    ReadVAsync(extents).get();
+}
+
+// One command and one reply per connection instead of one per extent
+std::future<void> CNetBlockIO::ReadVAsync(const std::vector<CBlockExtent> &extents)
+{
+    std::vector<std::future<void>> futs;
+    if (!vectored)
+    {
+        for(auto &e : extents) futs.push_back(ReadAsync(e.blockidx, e.n, e.d));
+    } else
+    {
+        std::vector<CVectorCommand> commands;
+        BuildVectorCommands(extents, commands);
+        for(auto &vc : commands)
+        {
+            CNetReadWriteBuffer &rb = *rbbufdata[vc.connection];
+            std::vector<int8_t> header = VectorHeader(COMMAND::READV, vc);
+            int32_t id = cmdid.fetch_add(1);
+            futs.push_back(rb.Read(id, vc.buffers));
+            rb.Write(id, header.data(), header.size());
+        }
+    }
+    if (futs.empty())
+    {
+        std::promise<void> promise;
+        promise.set_value();
+        return promise.get_future();
+    }
+    return WhenAll(std::move(futs));
+}
+
+void CNetBlockIO::WriteV(const std::vector<CBlockExtent> &extents)
+{
+    if (!vectored)
+    {
+        CAbstractBlockIO::WriteV(extents);
+        return;
+    }
+    std::vector<CVectorCommand> commands;
+    BuildVectorCommands(extents, commands);
+    for(auto &vc : commands)
+    {
+        std::vector<int8_t> header = VectorHeader(COMMAND::WRITEV, vc);
+        rbbufdata[vc.connection]->Write(cmdid.fetch_add(1), header.data(), header.size(), vc.buffers, vc.owners);
+    }
 }
@@ -15,30 +15,59 @@ typedef ssl::stream<tcp::socket> ssl_socket;
 #include <atomic>
 
 class CNetReadWriteBuffer;
+class CVectorCommand;
+
+struct CNetConfig
+{
+    size_t ringsize = 1024*1024; // initial size of the send buffer of each connection in bytes
+    size_t maxringsize = 16*1024*1024; // the send buffer grows up to this size under load
+    int nconnections = 1; // number of data connections. The blocks are striped across them
+    int niothreads = 1; // number of threads which serve the data connections
+};
 
 class CNetBlockIO : public CAbstractBlockIO
 {
 public:
-    CNetBlockIO(int _blocksize, const std::string &host, const std::string &port);
+    CNetBlockIO(int _blocksize, const std::string &host, const std::string &port, const CNetConfig &config = CNetConfig());
     ~CNetBlockIO();
 
     void Read(int blockidx, int n, int8_t* d);
+    std::future<void> ReadAsync(int blockidx, int n, int8_t* d) override;
     void Write(int blockidx, int n, int8_t* d);
+    void WriteShared(int blockidx, int n, const std::shared_ptr<const std::vector<int8_t>> &d) override;
+    void ReadV(const std::vector<CBlockExtent> &extents) override;
+    std::future<void> ReadVAsync(const std::vector<CBlockExtent> &extents) override;
+    void WriteV(const std::vector<CBlockExtent> &extents) override;
+    void Flush() override;
+    void Discard(const std::vector<CBlockExtent> &extents) override;
     int64_t GetFilesize() override;
     int64_t GetWriteCache() override;
     void GetInfo();
     void Close();
 
 private:
-    boost::asio::io_service io_service;
+    void Connect(ssl_socket &s, tcp::resolver::iterator iter, const char *name);
+    // All commands of a stripe use the same connection, which the server processes in order
+    int GetConnection(int blockidx) const { return (blockidx/STRIPEBLOCKS) % (int)rbbufdata.size(); }
+    static const int STRIPEBLOCKS = 64;
+    void BuildVectorCommands(const std::vector<CBlockExtent> &extents, std::vector<CVectorCommand> &commands);
+    static const size_t MAXEXTENTS = 256; // per vectored command
+    static const int64_t MAXVECTORBYTES = 4*1024*1024; // data per vectored command
+    bool vectored = false; // the server supports READV and WRITEV
+    bool flushable = false; // the server supports FLUSH
+    bool discardable = false; // the server supports DISCARD
+
+    boost::asio::io_service io_service; // control connection and the first data connections
     ssl::context ctx;
     ssl_socket sctrl;
-    ssl_socket sdata;
     std::atomic_int cmdid;
-    std::thread iothread;
-    std::unique_ptr<boost::asio::io_service::work> work;
+    // every io_service is run by one thread, so that the handlers of a connection never run concurrently
+    std::vector<std::unique_ptr<boost::asio::io_service>> dataservices; // for the io threads 1..n-1
+    std::vector<std::thread> iothreads;
+    std::vector<std::unique_ptr<boost::asio::io_service::work>> works;
+    std::vector<std::unique_ptr<ssl_socket>> sdata;
     std::unique_ptr<CNetReadWriteBuffer> rbbufctrl;
-    std::unique_ptr<CNetReadWriteBuffer> rbbufdata;
+    std::vector<std::unique_ptr<CNetReadWriteBuffer>> rbbufdata;
 };
 
 #endif
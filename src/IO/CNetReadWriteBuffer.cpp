@@ -1,14 +1,27 @@
 #include"Logger.h"
 #include "CNetReadWriteBuffer.h"
 
+#include<algorithm>
+#include<cstring>
+#include<stdexcept>
 
-CNetReadWriteBuffer::CNetReadWriteBuffer(ssl_socket &s) : socket(s)
+
+CNetReadWriteBuffer::CNetReadWriteBuffer(ssl_socket &s, size_t ringsize, size_t maxringsize) : maxringsize(maxringsize), socket(s)
 {
     // prepare write ring buffer
-    buf.assign(1024*1024, 0);
+    buf.assign(ringsize, 0);
     pushidx = 0;
     popidx = 0;
     bufsize = 0;
+    externalsize = 0;
+    writefailed = false;
+
+    rxbuf.assign(RXBUFSIZE, 0);
+    rxheaderlen = 0;
+    rxpayloadlen = 0;
+    rxsegment = 0;
+    rxsegmentofs = 0;
+    rxinpayload = false;
 
     // Start the async read loop
     AsyncRead();
@@ -35,7 +48,7 @@ void CNetReadWriteBuffer::Sync()
     }
     while(true)
     {
-        size_t n = bufsize.load();
+        size_t n = GetBytesInCache();
         if (n == 0)
         {
             LOG(LogLevel::DEBUG) << "CNetReadWriteBuffer: sync done";
@@ -48,43 +61,156 @@ void CNetReadWriteBuffer::Sync()
 
 std::future<void> CNetReadWriteBuffer::Read(int32_t id, int8_t *buf, int32_t size)
 {
-    CReadBufferDesc rbi(buf, size);
+    return Register(id, CReadBufferDesc(buf, size));
+}
+
+std::future<void> CNetReadWriteBuffer::Read(int32_t id, const CBufferList &segments)
+{
+    return Register(id, CReadBufferDesc(segments));
+}
+
+std::future<void> CNetReadWriteBuffer::Register(int32_t id, CReadBufferDesc &&rbi)
+{
     std::lock_guard<std::mutex> lock(readidmapmtx);
+    if (readerror)
+    {
+        rbi.promise.set_exception(readerror);
+        return rbi.promise.get_future();
+    }
     readidmap[id] = std::move(rbi);
     return readidmap[id].promise.get_future();
 }
 
 
-void CNetReadWriteBuffer::AsyncRead2(int32_t size, int32_t id)
+// Large payloads are read directly into their target, everything else into rxbuf
+void CNetReadWriteBuffer::AsyncRead()
 {
-    static CReadBufferDesc rbi;
-    std::lock_guard<std::mutex> lock(readidmapmtx);
-    auto it = readidmap.find(id);
-    assert(it != readidmap.end());
-    rbi = std::move(it->second);
-    readidmap.erase(it);
+    if (rxinpayload && (rxdesc.segments[rxsegment].second-rxsegmentofs >= RXBUFSIZE))
+    {
+        auto &segment = rxdesc.segments[rxsegment];
+        socket.async_read_some(
+        boost::asio::buffer(segment.first+rxsegmentofs, segment.second-rxsegmentofs),
+        [this](const boost::system::error_code& ec, std::size_t readbytes)
+        {
+            if (ec)
+            {
+                FailReads(std::make_exception_ptr(boost::system::system_error(ec)));
+                return;
+            }
+            Advance(readbytes);
+            Parse(nullptr, 0);
+            AsyncRead();
+        });
+        return;
+    }
 
-    boost::asio::async_read(
-    socket,
-    boost::asio::buffer(rbi.buf, rbi.size),
+    socket.async_read_some(
+    boost::asio::buffer(rxbuf.data(), rxbuf.size()),
     [this](const boost::system::error_code& ec, std::size_t readbytes)
     {
-        assert(readbytes == rbi.size);
-        rbi.promise.set_value();
+        if (ec)
+        {
+            FailReads(std::make_exception_ptr(boost::system::system_error(ec)));
+            return;
+        }
+        try
+        {
+            Parse(rxbuf.data(), readbytes);
+        } catch(...)
+        {
+            FailReads(std::current_exception());
+            return;
+        }
         AsyncRead();
     });
 }
 
-void CNetReadWriteBuffer::AsyncRead()
+// Splits the stream into replies and copies each payload into the buffer registered for its id
+void CNetReadWriteBuffer::Parse(const int8_t *d, size_t n)
 {
-    static int32_t data[2];
-    boost::asio::async_read(
-    socket,
-    boost::asio::buffer(data, 8),
-    [this](const boost::system::error_code& ec, std::size_t readbytes)
+    for(;;)
     {
-        AsyncRead2(data[0]-8, data[1]);
-    });
+        if (rxinpayload)
+        {
+            while((n > 0) && (rxpayloadlen < rxdesc.size))
+            {
+                auto &segment = rxdesc.segments[rxsegment];
+                size_t size = std::min(n, segment.second-rxsegmentofs);
+                memcpy(segment.first+rxsegmentofs, d, size);
+                Advance(size);
+                d += size;
+                n -= size;
+            }
+            if (rxpayloadlen < rxdesc.size) return;
+            rxdesc.promise.set_value();
+            rxinpayload = false;
+        }
+        if (n == 0) return;
+
+        size_t size = std::min(n, sizeof(rxheader)-rxheaderlen);
+        memcpy((int8_t*)rxheader+rxheaderlen, d, size);
+        rxheaderlen += size;
+        d += size;
+        n -= size;
+        if (rxheaderlen < sizeof(rxheader)) return;
+        rxheaderlen = 0;
+
+        int32_t id = rxheader[1];
+        {
+            std::lock_guard<std::mutex> lock(readidmapmtx);
+            auto it = readidmap.find(id);
+            if (it == readidmap.end())
+                throw std::runtime_error("Reply with unknown id " + std::to_string(id));
+            rxdesc = std::move(it->second);
+            readidmap.erase(it);
+        }
+        if ((size_t)rxheader[0]-8 != rxdesc.size)
+        {
+            rxdesc.promise.set_exception(std::make_exception_ptr(std::runtime_error("Reply of unexpected size")));
+            throw std::runtime_error("Reply with " + std::to_string(rxheader[0]-8) + " bytes instead of " + std::to_string(rxdesc.size));
+        }
+        rxpayloadlen = 0;
+        rxsegment = 0;
+        rxsegmentofs = 0;
+        Advance(0);
+        rxinpayload = true;
+    }
+}
+
+// Moves the receive position of the current payload, skipping buffers which are full
+void CNetReadWriteBuffer::Advance(size_t n)
+{
+    rxpayloadlen += n;
+    rxsegmentofs += n;
+    while((rxsegment < rxdesc.segments.size()) && (rxsegmentofs >= rxdesc.segments[rxsegment].second))
+    {
+        rxsegment++;
+        rxsegmentofs = 0;
+    }
+}
+
+// The stream is out of sync or closed. All pending and future reads fail.
+void CNetReadWriteBuffer::FailReads(const std::exception_ptr &error)
+{
+    std::lock_guard<std::mutex> lock(readidmapmtx);
+    if (!readerror)
+    {
+        try
+        {
+            std::rethrow_exception(error);
+        } catch(std::exception &e)
+        {
+            if (!readidmap.empty() || rxinpayload)
+            {
+                LOG(LogLevel::ERR) << "Receive failed: " << e.what();
+            }
+        }
+        readerror = error;
+    }
+    if (rxinpayload) rxdesc.promise.set_exception(error);
+    rxinpayload = false;
+    for(auto &it : readidmap) it.second.promise.set_exception(error);
+    readidmap.clear();
 }
 
 // --------------------------------------------------------
@@ -100,14 +226,59 @@ void CNetReadWriteBuffer::Write(int32_t id, int8_t *d, int n)
     AsyncWrite();
 }
 
+void CNetReadWriteBuffer::Write(int32_t id, int8_t *header, int nheader, int8_t *payload, int npayload)
+{
+    std::lock_guard<std::mutex> lock(writemtx);
+    int32_t data[2];
+    data[0] = nheader+npayload+8; // total length of packet
+    data[1] = id;  // unique id of packet
+    Push((int8_t*)data, 8);
+    Push(header, nheader);
+    Push(payload, npayload);
+    AsyncWrite();
+}
+
+void CNetReadWriteBuffer::Write(int32_t id, int8_t *header, int nheader, const std::shared_ptr<const int8_t> &payload, int npayload)
+{
+    std::lock_guard<std::mutex> lock(writemtx);
+    int32_t data[2];
+    data[0] = nheader+npayload+8; // total length of packet
+    data[1] = id;  // unique id of packet
+    Push((int8_t*)data, 8);
+    Push(header, nheader);
+    PushExternal(payload, npayload);
+    AsyncWrite();
+}
+
+void CNetReadWriteBuffer::Write(int32_t id, int8_t *header, int nheader, const CBufferList &payload, const std::vector<std::shared_ptr<const int8_t>> &owners)
+{
+    std::lock_guard<std::mutex> lock(writemtx);
+    int32_t data[2];
+    data[0] = nheader+8; // total length of packet
+    for(auto &p : payload) data[0] += p.second;
+    data[1] = id;  // unique id of packet
+    Push((int8_t*)data, 8);
+    Push(header, nheader);
+    for(size_t i=0; i<payload.size(); i++)
+    {
+        if ((i < owners.size()) && owners[i])
+            PushExternal(owners[i], payload[i].second);
+        else
+            Push(payload[i].first, payload[i].second);
+    }
+    AsyncWrite();
+}
+
+// Copies the packet into the ring buffer in at most two pieces per pass
 void CNetReadWriteBuffer::Push(int8_t *d, int n)
 {
     //printf("Push %i bytes\n", n);
-    for(int i=0; i<n; i++)
+    while(n > 0)
     {
         // ringbuffer full. Block all further evaluations
         if (bufsize.load() > buf.size()-2)
         {
+            if (Grow()) continue;
             LOG(LogLevel::DEEP) << "Ringbuffer full: blocking";
             AsyncWrite();
             std::unique_lock<std::mutex> lock(condmtx);
@@ -116,13 +287,54 @@ void CNetReadWriteBuffer::Push(int8_t *d, int n)
                 cond.wait_for(lock, std::chrono::milliseconds(500));
             }
         }
-        buf[pushidx] = d[i];
-        pushidx++;
-        bufsize.fetch_add(1);
+        // one byte stays free, so that a full buffer can be distinguished from an empty one
+        size_t nfree = buf.size()-1-bufsize.load();
+        size_t size = std::min<size_t>(std::min<size_t>(n, nfree), buf.size()-pushidx);
+        memcpy(&buf[pushidx], d, size);
+        pushidx += size;
         if (pushidx >= buf.size()) pushidx -= buf.size();
+        {
+            std::lock_guard<std::mutex> lock(chunkmtx);
+            if (chunks.empty() || chunks.back().external)
+                chunks.push_back(CSendChunk{size, nullptr});
+            else
+                chunks.back().size += size;
+            bufsize.fetch_add(size);
+        }
+        d += size;
+        n -= size;
     }
 }
 
+void CNetReadWriteBuffer::PushExternal(const std::shared_ptr<const int8_t> &d, int n)
+{
+    if (n <= 0) return;
+    std::lock_guard<std::mutex> lock(chunkmtx);
+    chunks.push_back(CSendChunk{(size_t)n, d});
+    externalsize.fetch_add(n);
+}
+
+// Doubles the ring buffer under sustained load. Only possible while no write is in flight,
+// because the write points into the buffer. The caller holds writemtx.
+bool CNetReadWriteBuffer::Grow()
+{
+    if (buf.size()*2 > maxringsize) return false;
+    std::lock_guard<std::mutex> lock(wpmutex);
+    if (write_in_progress.test_and_set()) return false; // it was set. Try again later
+    std::vector<int8_t> newbuf(buf.size()*2);
+    size_t n = bufsize.load();
+    size_t first = std::min<size_t>(n, buf.size()-popidx);
+    memcpy(&newbuf[0], &buf[popidx], first);
+    memcpy(&newbuf[first], &buf[0], n-first);
+    buf.swap(newbuf);
+    popidx = 0;
+    pushidx = n;
+    write_in_progress.clear();
+    LOG(LogLevel::DEBUG) << "Ringbuffer grown to " << buf.size() << " bytes";
+    return true;
+}
+
+// Sends the queued chunks with one gather write
 void CNetReadWriteBuffer::AsyncWrite()
 {
     wpmutex.lock();
@@ -130,27 +342,107 @@ void CNetReadWriteBuffer::AsyncWrite()
     wpmutex.unlock();
 
     if (wip) return; // return if it already runs
-    //if (bufsize.load() > 0) printf("write size=%i\n", bufsize.load());
-    size_t sendsize = std::min(buf.size()-popidx, bufsize.load());
+
+    if (writefailed.load())
+    {
+        // nothing can be sent anymore. Release waiting writers and Sync
+        {
+            std::lock_guard<std::mutex> lock(chunkmtx);
+            chunks.clear();
+            popidx = pushidx;
+            bufsize = 0;
+            externalsize = 0;
+        }
+        wpmutex.lock();
+        write_in_progress.clear();
+        wpmutex.unlock();
+        cond.notify_all();
+        return;
+    }
+
+    std::vector<boost::asio::const_buffer> buffers;
+    std::vector<std::shared_ptr<const int8_t>> keepalive;
+    {
+        std::lock_guard<std::mutex> lock(chunkmtx);
+        size_t idx = popidx;
+        for(auto &chunk : chunks)
+        {
+            if (buffers.size() >= MAXGATHER) break;
+            if (chunk.external)
+            {
+                buffers.emplace_back(chunk.external.get(), chunk.size);
+                keepalive.push_back(chunk.external);
+                continue;
+            }
+            size_t first = std::min<size_t>(chunk.size, buf.size()-idx);
+            buffers.emplace_back(&buf[idx], first);
+            if (chunk.size > first) buffers.emplace_back(&buf[0], chunk.size-first);
+            idx += chunk.size;
+            if (idx >= buf.size()) idx -= buf.size();
+        }
+    }
+    if (buffers.empty())
+    {
+        wpmutex.lock();
+        write_in_progress.clear();
+        wpmutex.unlock();
+        return;
+    }
+
     boost::asio::async_write(
     socket,
-    boost::asio::buffer(&(buf[popidx]), sendsize),
-    [this](const boost::system::error_code& ec, std::size_t writtenbytes)
+    buffers,
+    [this, keepalive = std::move(keepalive)](const boost::system::error_code& ec, std::size_t writtenbytes)
     {
-        //std::unique_lock<std::mutex> lock(condmtx);
         //printf("written bytes %li\n", writtenbytes);
-        popidx += writtenbytes;
-        bufsize.fetch_sub(writtenbytes);
-        if (popidx >= buf.size()) popidx -= buf.size();
-        cond.notify_one();
+        if (ec)
+        {
+            LOG(LogLevel::ERR) << "Send failed: " << ec.message();
+            writefailed = true;
+            // A read may still be receiving into the buffer of a caller. The shutdown makes it
+            // complete with an error, and the read handler fails the pending reads.
+            boost::system::error_code ignored;
+            socket.lowest_layer().shutdown(tcp::socket::shutdown_both, ignored);
+            wpmutex.lock();
+            write_in_progress.clear();
+            wpmutex.unlock();
+            AsyncWrite();
+            return;
+        }
+        bool more;
+        {
+            // the ring bytes of a chunk may have grown meanwhile. Only the bytes written are removed
+            std::lock_guard<std::mutex> lock(chunkmtx);
+            while(writtenbytes > 0)
+            {
+                CSendChunk &chunk = chunks.front();
+                size_t size = std::min(writtenbytes, chunk.size);
+                if (chunk.external)
+                {
+                    externalsize.fetch_sub(size);
+                    chunk.external = std::shared_ptr<const int8_t>(chunk.external, chunk.external.get()+size);
+                } else
+                {
+                    popidx += size;
+                    if (popidx >= buf.size()) popidx -= buf.size();
+                    bufsize.fetch_sub(size);
+                }
+                chunk.size -= size;
+                writtenbytes -= size;
+                if (chunk.size == 0) chunks.pop_front();
+            }
+            more = !chunks.empty();
+        }
         wpmutex.lock();
         write_in_progress.clear();
         wpmutex.unlock();
-        if (bufsize.load() > 0) AsyncWrite();
+        // a writer waiting for space may grow the buffer now
+        cond.notify_one();
+        if (more) AsyncWrite();
     });
 }
 
 int64_t CNetReadWriteBuffer::GetBytesInCache()
 {
-    return bufsize.load();
+    return bufsize.load() + externalsize.load();
 }
@@ -6,6 +6,8 @@
 #include<future>
 #include<atomic>
 #include<vector>
+#include<deque>
+#include<memory>
 
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
@@ -14,39 +16,85 @@ using boost::asio::ip::tcp;
 namespace ssl = boost::asio::ssl;
 typedef ssl::stream<tcp::socket> ssl_socket;
 
+// buffers which are filled one after another
+using CBufferList = std::vector<std::pair<int8_t*, size_t>>;
+
 class CReadBufferDesc
 {
     public:
-    explicit CReadBufferDesc(int8_t *_buf= nullptr, size_t _size=0) : buf(_buf), size(_size) {}
-    int8_t *buf;               // which buffer to fill
-    size_t size;              // size of buffer
+    explicit CReadBufferDesc(int8_t *_buf= nullptr, size_t _size=0) : segments{{_buf, _size}}, size(_size) {}
+    explicit CReadBufferDesc(const CBufferList &_segments) : segments(_segments), size(0)
+    {
+        for(auto &s : segments) size += s.second;
+    }
+    CBufferList segments;      // which buffers to fill
+    size_t size;              // total size of the buffers
     std::promise<void> promise; // which task to notify
 };
 
+// Part of the outgoing stream. Either bytes in the ring buffer or a buffer of the caller
+class CSendChunk
+{
+    public:
+    size_t size;
+    std::shared_ptr<const int8_t> external; // empty for bytes in the ring buffer
+};
+
 class CNetReadWriteBuffer
 {
     public:
-    explicit CNetReadWriteBuffer(ssl_socket &s);
+    explicit CNetReadWriteBuffer(ssl_socket &s, size_t ringsize = 1024*1024, size_t maxringsize = 16*1024*1024);
     ~CNetReadWriteBuffer();
     void Write(int32_t id, int8_t *d, int n);
+    void Write(int32_t id, int8_t *header, int nheader, int8_t *payload, int npayload);
+    // The payload is not copied. It is sent from its own buffer, which is kept alive until written
+    void Write(int32_t id, int8_t *header, int nheader, const std::shared_ptr<const int8_t> &payload, int npayload);
+    // Buffers with an owner are sent from their own memory like the shared payload above
+    void Write(int32_t id, int8_t *header, int nheader, const CBufferList &payload, const std::vector<std::shared_ptr<const int8_t>> &owners = {});
     std::future<void> Read(int32_t id, int8_t *buf, int32_t size);
+    // The payload of the reply is scattered over the buffers
+    std::future<void> Read(int32_t id, const CBufferList &segments);
     void Sync();
     int64_t GetBytesInCache();
 
     private:
 
-    // for reading
+    // for reading. The replies are parsed from large chunks, several per socket read.
+    // All state except readidmap belongs to the io thread
+    std::future<void> Register(int32_t id, CReadBufferDesc &&rbi);
     void AsyncRead();
-    void AsyncRead2(int32_t size, int32_t id);
+    void Parse(const int8_t *d, size_t n);
+    void Advance(size_t n);
+    void FailReads(const std::exception_ptr &error);
     std::mutex readidmapmtx;
     std::map<int32_t, CReadBufferDesc> readidmap;
+    std::exception_ptr readerror; // protected by readidmapmtx. Set once the stream has failed
+
+    std::vector<int8_t> rxbuf;
+    int32_t rxheader[2]; // length and id of the current reply
+    size_t rxheaderlen; // bytes of the header received so far
+    CReadBufferDesc rxdesc; // target of the current reply
+    size_t rxpayloadlen; // bytes of the payload received so far
+    size_t rxsegment; // current buffer of rxdesc
+    size_t rxsegmentofs; // bytes of the current buffer received so far
+    bool rxinpayload;
+    static const size_t RXBUFSIZE = 64*1024;
 
     // for writing
     void Push(int8_t *d, int n);
+    void PushExternal(const std::shared_ptr<const int8_t> &d, int n);
+    bool Grow();
     void AsyncWrite();
 
-    // write buffer
+    // order of the ring buffer bytes and the external buffers in the stream
+    std::mutex chunkmtx;
+    std::deque<CSendChunk> chunks;
+    std::atomic_size_t externalsize;
+    static const size_t MAXGATHER = 64; // maximum number of buffers per socket write
+
+    // write buffer. It doubles up to maxringsize whenever it runs full
     std::vector<int8_t> buf;
+    size_t maxringsize;
     unsigned int pushidx;
     unsigned int popidx;
     std::atomic_size_t bufsize;
@@ -56,6 +104,7 @@ class CNetReadWriteBuffer
 
     std::atomic_flag write_in_progress = ATOMIC_FLAG_INIT;
     std::mutex wpmutex;
+    std::atomic_bool writefailed; // the stream is broken. Queued bytes are dropped
 
     std::mutex writemtx;
 
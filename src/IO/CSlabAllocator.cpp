@@ -0,0 +1,191 @@
+#include "Logger.h"
+#include "CSlabAllocator.h"
+
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#elif defined(_WIN32)
+#include <malloc.h>
+#endif
+
+CSlabAllocator::CSlabAllocator(size_t _objsize, size_t _chunksize, bool _hugepages, bool _lockmemory, unsigned int _nstripes) :
+    objsize(_objsize), chunksize(_chunksize), hugepages(_hugepages), lockmemory(_lockmemory), nstripes(_nstripes), nobjects(0), nchunks(0)
+{
+    // the free list is stored inside the free objects
+    objsize = std::max(objsize, sizeof(void*));
+    objsize = (objsize + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1);
+    assert((chunksize & (chunksize-1)) == 0);
+    firstslot = (sizeof(CChunk) + objsize - 1) / objsize;
+    assert(chunksize/objsize > firstslot);
+    nslots = chunksize/objsize - firstslot;
+    assert(nstripes > 0);
+    stripes.reset(new CStripe[nstripes]);
+#ifndef __linux__
+    if (hugepages || lockmemory)
+    {
+        LOG(LogLevel::WARN) << "Slab: huge pages and locked memory are only supported on Linux";
+        hugepages = false;
+        lockmemory = false;
+    }
+#endif
+}
+
+CSlabAllocator::~CSlabAllocator()
+{
+    if (nobjects.load() != 0)
+    {
+        LOG(LogLevel::WARN) << "Slab: " << nobjects.load() << " objects still in use";
+    }
+    // chunks which are still in use are not known anymore
+    for(unsigned int i=0; i<nstripes; i++)
+    {
+        while(stripes[i].partial != nullptr)
+        {
+            CChunk *chunk = stripes[i].partial;
+            Unlink(stripes[i], chunk);
+            DeleteChunk(chunk);
+        }
+        if (stripes[i].spare != nullptr) DeleteChunk(stripes[i].spare);
+    }
+}
+
+CSlabAllocator::CChunk* CSlabAllocator::NewChunk(CStripe &stripe)
+{
+    void *p = nullptr;
+    size_t size = chunksize;
+#ifdef __linux__
+    if (hugepages)
+    {
+        p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            // no reserved huge pages. Ask for transparent huge pages instead
+            p = nullptr;
+        } else
+        if ((reinterpret_cast<uintptr_t>(p) & (size-1)) != 0)
+        {
+            munmap(p, size);
+            p = nullptr;
+        }
+    }
+    if (p == nullptr)
+    {
+        // map twice the size and cut off the unaligned parts
+        auto *q = static_cast<int8_t*>(mmap(nullptr, 2*size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+        if (q == MAP_FAILED) throw std::bad_alloc();
+        size_t head = (size - reinterpret_cast<uintptr_t>(q) % size) % size;
+        if (head > 0) munmap(q, head);
+        munmap(q+head+size, size-head);
+        p = q+head;
+        if (hugepages) madvise(p, size, MADV_HUGEPAGE);
+    }
+    if (lockmemory && (mlock(p, size) != 0))
+    {
+        LOG(LogLevel::WARN) << "Slab: Cannot lock memory. Check 'ulimit -l'";
+        lockmemory = false;
+    }
+#elif defined(_WIN32)
+    p = _aligned_malloc(size, size);
+    if (p == nullptr) throw std::bad_alloc();
+#else
+    if (posix_memalign(&p, size, size) != 0) throw std::bad_alloc();
+#endif
+    nchunks++;
+
+    // the slots are handed out in order the first time, so that untouched pages stay unused
+    auto *chunk = static_cast<CChunk*>(p);
+    chunk->stripe = &stripe;
+    chunk->freelist = nullptr;
+    chunk->nfree = nslots;
+    chunk->nunused = nslots;
+    chunk->prev = nullptr;
+    chunk->next = nullptr;
+    return chunk;
+}
+
+void CSlabAllocator::DeleteChunk(CChunk *chunk)
+{
+#ifdef __linux__
+    munmap(chunk, chunksize);
+#elif defined(_WIN32)
+    _aligned_free(chunk);
+#else
+    free(chunk);
+#endif
+    nchunks--;
+}
+
+void CSlabAllocator::Link(CStripe &stripe, CChunk *chunk)
+{
+    chunk->prev = nullptr;
+    chunk->next = stripe.partial;
+    if (stripe.partial != nullptr) stripe.partial->prev = chunk;
+    stripe.partial = chunk;
+}
+
+void CSlabAllocator::Unlink(CStripe &stripe, CChunk *chunk)
+{
+    if (chunk->prev != nullptr) chunk->prev->next = chunk->next; else stripe.partial = chunk->next;
+    if (chunk->next != nullptr) chunk->next->prev = chunk->prev;
+    chunk->prev = nullptr;
+    chunk->next = nullptr;
+}
+
+void* CSlabAllocator::Allocate(unsigned int stripeidx)
+{
+    CStripe &stripe = stripes[stripeidx % nstripes];
+    std::lock_guard<std::mutex> lock(stripe.mtx);
+    CChunk *chunk = stripe.partial;
+    if (chunk == nullptr)
+    {
+        chunk = (stripe.spare != nullptr)?stripe.spare:NewChunk(stripe);
+        stripe.spare = nullptr;
+        Link(stripe, chunk);
+    }
+    void *p;
+    if (chunk->freelist != nullptr)
+    {
+        p = chunk->freelist;
+        chunk->freelist = *static_cast<void**>(p);
+    } else
+    {
+        p = reinterpret_cast<int8_t*>(chunk) + (firstslot + nslots - chunk->nunused)*objsize;
+        chunk->nunused--;
+    }
+    if (--chunk->nfree == 0) Unlink(stripe, chunk);
+    nobjects++;
+    return p;
+}
+
+void CSlabAllocator::Free(void *p)
+{
+    auto *chunk = reinterpret_cast<CChunk*>(reinterpret_cast<uintptr_t>(p) & ~(uintptr_t)(chunksize-1));
+    CStripe &stripe = *chunk->stripe;
+    CChunk *empty = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(stripe.mtx);
+        *static_cast<void**>(p) = chunk->freelist;
+        chunk->freelist = p;
+        if (chunk->nfree++ == 0) Link(stripe, chunk);
+        if (chunk->nfree == nslots)
+        {
+            Unlink(stripe, chunk);
+            if (stripe.spare == nullptr) stripe.spare = chunk; else empty = chunk;
+        }
+    }
+    nobjects--;
+    if (empty != nullptr) DeleteChunk(empty);
+}
+
+int64_t CSlabAllocator::GetNObjects()
+{
+    return nobjects.load();
+}
+
+int64_t CSlabAllocator::GetReservedBytes()
+{
+    return nchunks.load()*chunksize;
+}
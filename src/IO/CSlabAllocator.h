@@ -0,0 +1,102 @@
+#ifndef CSLABALLOCATOR_H
+#define CSLABALLOCATOR_H
+
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+#include <cstddef>
+#include <cassert>
+#include <new>
+
+// Hands out objects of a fixed size which are carved out of large chunks. The chunks are aligned
+// to their size, so that a freed object finds its chunk. Each chunk keeps its own free list and
+// is returned as soon as it is empty. The allocator is split into stripes with their own lock,
+// so that callers which use different stripes, like the shards of the cache, don't contend.
+class CSlabAllocator
+{
+public:
+    CSlabAllocator(size_t _objsize, size_t _chunksize, bool _hugepages=false, bool _lockmemory=false, unsigned int _nstripes=1);
+    ~CSlabAllocator();
+    void* Allocate(unsigned int stripe=0);
+    void Free(void *p);
+
+    size_t GetObjectSize() const { return objsize; }
+    int64_t GetNObjects();
+    int64_t GetReservedBytes();
+
+private:
+    struct CStripe;
+
+    // stored in the first slots of the chunk
+    struct CChunk
+    {
+        CStripe *stripe;
+        void *freelist;
+        size_t nfree;
+        size_t nunused; // slots at the end which were never handed out
+        CChunk *prev; // in the list of chunks with free slots
+        CChunk *next;
+    };
+
+    struct CStripe
+    {
+        std::mutex mtx;
+        CChunk *partial = nullptr; // chunks with free slots
+        CChunk *spare = nullptr; // one empty chunk is kept to avoid mapping chunks back and forth
+    };
+
+    CChunk* NewChunk(CStripe &stripe);
+    void DeleteChunk(CChunk *chunk);
+    void Unlink(CStripe &stripe, CChunk *chunk);
+    void Link(CStripe &stripe, CChunk *chunk);
+
+    size_t objsize;
+    size_t chunksize;
+    size_t nslots; // usable slots per chunk
+    size_t firstslot; // offset of the first slot
+    bool hugepages;
+    bool lockmemory;
+
+    unsigned int nstripes;
+    std::unique_ptr<CStripe[]> stripes;
+    std::atomic<int64_t> nobjects;
+    std::atomic<int64_t> nchunks;
+};
+
+// STL allocator on top of CSlabAllocator. Used with std::allocate_shared, so that the
+// object and the control block of the shared_ptr end up in one slot of the slab.
+// The slab must have slots of SLOTSIZE bytes. allocate is instantiated for the type
+// which the standard library really allocates, so a slot which is too small fails
+// to compile.
+template<typename T, size_t SLOTSIZE>
+class CSlabSTLAllocator
+{
+public:
+    using value_type = T;
+    static const size_t SLOTBYTES = SLOTSIZE;
+    template<typename U> struct rebind { using other = CSlabSTLAllocator<U, SLOTSIZE>; };
+
+    explicit CSlabSTLAllocator(CSlabAllocator &_slab, unsigned int _stripe=0) : slab(&_slab), stripe(_stripe) { assert(slab->GetObjectSize() >= SLOTSIZE); }
+    template<typename U> CSlabSTLAllocator(const CSlabSTLAllocator<U, SLOTSIZE> &other) : slab(other.slab), stripe(other.stripe) {}
+
+    T* allocate(size_t n)
+    {
+        static_assert(sizeof(T) <= SLOTSIZE, "slab slot too small");
+        static_assert(alignof(T) <= alignof(std::max_align_t), "slab slot not aligned");
+        if (n != 1) throw std::bad_alloc();
+        return static_cast<T*>(slab->Allocate(stripe));
+    }
+    void deallocate(T *p, size_t n) { slab->Free(p); }
+
+    CSlabAllocator *slab;
+    unsigned int stripe;
+};
+
+template<typename T, typename U, size_t SLOTSIZE>
+bool operator==(const CSlabSTLAllocator<T, SLOTSIZE> &a, const CSlabSTLAllocator<U, SLOTSIZE> &b) { return a.slab == b.slab; }
+template<typename T, typename U, size_t SLOTSIZE>
+bool operator!=(const CSlabSTLAllocator<T, SLOTSIZE> &a, const CSlabSTLAllocator<U, SLOTSIZE> &b) { return a.slab != b.slab; }
+
+#endif
@@ -24,6 +24,10 @@ void CStatusView::Work()
     std::string ncached;
     std::string ndirty;
     std::string nwritecache;
+    std::string nhits;
+    std::string nmisses;
+    std::string nevictions;
+    std::string cachememory;
 
     while(wait_for_terminate.wait_for(std::chrono::seconds(1)) == std::future_status::timeout)
     {
@@ -47,15 +51,27 @@ void CStatusView::Work()
         {
             ncached = std::to_string(cbio->GetNCachedBlocks());
             ndirty = std::to_string(cbio->GetNDirty());
+            nhits = std::to_string(cbio->GetNCacheHits());
+            nmisses = std::to_string(cbio->GetNCacheMisses());
+            nevictions = std::to_string(cbio->GetNEvictions());
+            cachememory = std::to_string(cbio->GetCacheMemory()/(1024*1024)) + " MB";
         } else
         {
             ncached = "-";
             ndirty = "-";
+            nhits = "-";
+            nmisses = "-";
+            nevictions = "-";
+            cachememory = "-";
         }
         LOG(LogLevel::INFO) <<
         "used inodes: " << ninodes << 
         " cached blocks: "<< ncached <<
         " dirty blocks: " << ndirty <<
+        " hits: " << nhits <<
+        " misses: " << nmisses <<
+        " evictions: " << nevictions <<
+        " cache memory: " << cachememory <<
         " write cache: " << nwritecache;
     }
 }
@@ -32,6 +32,23 @@ void PrintUsage(char *argv[])
     printf("  --host [hostname]   default: 'localhost'\n");
     printf("  --port [port]       default: '62000'\n");
     printf("  --cryptcache        crypt cache in RAM\n");
+    printf("  --cachesize [MB]    maximum size of the block cache. default: 256\n");
+    printf("  --writebackthreads [n] number of encryption threads for the writeback\n");
+    printf("                      default: number of cores\n");
+    printf("  --hugepages         back the block cache with huge pages\n");
+    printf("  --mlock             lock the block cache in RAM\n");
+    printf("  --readbypass [KB]   reads of this size are decrypted directly into the\n");
+    printf("                      caller's buffer. 0 disables. default: 128\n");
+    printf("  --readbypassnocache don't add the blocks of such reads to the cache\n");
+    printf("  --writearound [KB]  writes of this size are not cached. 0 disables. default: 0\n");
+    printf("  --dirtyhigh [MB]    writers are throttled above this amount of dirty data. default: 64\n");
+    printf("  --dirtylow [MB]     writeback starts immediately above this amount. default: 16\n");
+    printf("  --cryptthreads [n]  number of threads which decrypt large reads. default: 1\n");
+    printf("  --netbuffer [MB]    maximum size of the send buffer per connection. default: 16\n");
+    printf("  --netconnections [n] number of data connections to the server. default: 1\n");
+    printf("  --netthreads [n]    number of threads for the data connections. default: 1\n");
+    printf("  --zeromap           add a zero map to an older filesystem. Older clients\n");
+    printf("                      cannot mount it afterwards\n");
     printf("  --info              Prints information about filesystem\n");
     printf("  --fragments         Prints information about the fragments\n");
     printf("  --rootdir           Print root directory\n");
@@ -101,6 +118,20 @@ int main(int argc, char *argv[])
             {"cryptcache", no_argument,       nullptr,  0 },
             {"test",       no_argument,       nullptr,  0 },
             {"web",        no_argument,       nullptr,  0 },
+            {"cachesize",  required_argument, nullptr,  0 },
+            {"writebackthreads", required_argument, nullptr,  0 },
+            {"hugepages",  no_argument,       nullptr,  0 },
+            {"mlock",      no_argument,       nullptr,  0 },
+            {"readbypass", required_argument, nullptr,  0 },
+            {"readbypassnocache", no_argument, nullptr, 0 },
+            {"writearound", required_argument, nullptr,  0 },
+            {"dirtyhigh",  required_argument, nullptr,  0 },
+            {"dirtylow",   required_argument, nullptr,  0 },
+            {"cryptthreads", required_argument, nullptr, 0 },
+            {"netbuffer",  required_argument, nullptr,  0 },
+            {"netconnections", required_argument, nullptr, 0 },
+            {"netthreads", required_argument, nullptr,  0 },
+            {"zeromap",    no_argument,       nullptr,  0 },
             {nullptr,                0,       nullptr,  0 }
         };
 
@@ -170,6 +201,62 @@ int main(int argc, char *argv[])
                     #endif
                     break;
 
+                case 14:
+                    handler.cacheconfig.maxcachesize = atoll(optarg)*1024*1024;
+                    break;
+
+                case 15:
+                    handler.cacheconfig.writebackthreads = atoi(optarg);
+                    break;
+
+                case 16:
+                    handler.cacheconfig.hugepages = true;
+                    break;
+
+                case 17:
+                    handler.cacheconfig.lockmemory = true;
+                    break;
+
+                case 18:
+                    handler.cacheconfig.bypasssize = atoll(optarg)*1024;
+                    break;
+
+                case 19:
+                    handler.cacheconfig.bypasspopulate = false;
+                    break;
+
+                case 20:
+                    handler.cacheconfig.writearoundsize = atoll(optarg)*1024;
+                    break;
+
+                case 21:
+                    handler.cacheconfig.dirtyhigh = atoll(optarg)*1024*1024;
+                    break;
+
+                case 22:
+                    handler.cacheconfig.dirtylow = atoll(optarg)*1024*1024;
+                    break;
+
+                case 23:
+                    handler.cacheconfig.cryptthreads = atoi(optarg);
+                    break;
+
+                case 24:
+                    handler.netconfig.maxringsize = atoll(optarg)*1024*1024;
+                    break;
+
+                case 25:
+                    handler.netconfig.nconnections = atoi(optarg);
+                    break;
+
+                case 26:
+                    handler.netconfig.niothreads = atoi(optarg);
+                    break;
+
+                case 27:
+                    handler.fsconfig.zeromap = true;
+                    break;
+
                 case 0: // help
                 default:
                     PrintUsage(argv);
@@ -241,6 +328,9 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    // only a mount or the test changes the filesystem
+    handler.fsconfig.readonly = info || showfragments || check || rootdir;
+
     char *pass = getpass("Password: ");
     bool ret = handler.Decrypt(pass).get();
     memset(pass, 0, strlen(pass));
@@ -563,6 +563,24 @@ PDOKAN_FILE_INFO DokanFileInfo)
 
     return STATUS_SUCCESS;
 }
+
+// The cache does not track the blocks per file. Everything is synced
+static NTSTATUS DOKAN_CALLBACK Dokan_FlushFileBuffers(LPCWSTR FileName, PDOKAN_FILE_INFO DokanFileInfo)
+{
+    LOG(LogLevel::DEBUG) << "Dokan: FlushFileBuffers '" << wstring_to_utf8(FileName) << "'";
+    try
+    {
+        fs->Sync();
+    } catch(const int &err)
+    {
+        return errno_to_nstatus(err);
+    } catch(const std::exception &)
+    {
+        return STATUS_UNEXPECTED_IO_ERROR;
+    }
+    return STATUS_SUCCESS;
+}
+
 /*
 static NTSTATUS DOKAN_CALLBACK Dokan_LockFile(LPCWSTR FileName,
                                             LONGLONG ByteOffset,
@@ -642,6 +660,7 @@ int StartDokan(int argc, char *argv[], const char* _mountpoint, CFilesystem &_fs
     dokanOperations.CloseFile            = Dokan_CloseFile;
     dokanOperations.ReadFile             = Dokan_ReadFile;
     dokanOperations.WriteFile            = Dokan_WriteFile;
+    dokanOperations.FlushFileBuffers     = Dokan_FlushFileBuffers;
     dokanOperations.GetFileInformation   = Dokan_GetFileInformation;
     dokanOperations.FindFiles            = Dokan_FindFiles;
     dokanOperations.FindFilesWithPattern = NULL;
@@ -295,6 +295,28 @@ static int fuse_statfs(const char *path, struct statvfs *buf)
     return 0;
 }
 
+// The cache does not track the blocks per file. Everything is synced
+static int fuse_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    LOG(LogLevel::DEBUG) << "FUSE: fsync '" << path << "'";
+    try
+    {
+        fs->Sync();
+    } catch(const int &err)
+    {
+        return -err;
+    } catch(const std::exception &)
+    {
+        return -EIO;
+    }
+    return 0;
+}
+
+static int fuse_fsyncdir(const char *path, int datasync, struct fuse_file_info *fi)
+{
+    return fuse_fsync(path, datasync, fi);
+}
+
 int StopFuse()
 {
     if (fs == NULL) return EXIT_SUCCESS;
@@ -338,6 +360,8 @@ int StartFuse(int argc, char *argv[], const char* _mountpoint, CFilesystem &_fs)
     fuse_oper.chown       = fuse_chown;
     fuse_oper.statfs      = fuse_statfs;
     fuse_oper.utimens     = fuse_utimens;
+    fuse_oper.fsync       = fuse_fsync;
+    fuse_oper.fsyncdir    = fuse_fsyncdir;
     //fuse_oper.flag_nullpath_ok = 1;
 
     fuse_chan = fuse_mount(_mountpoint, &args);
@@ -57,7 +57,7 @@ std::future<bool> CFSHandler::ConnectNET(const std::string hostname, const std::
     std::future<bool> result( std::async([this, hostname, port]{
         try
         {
-            bio.reset(new CNetBlockIO(4096, hostname, port));
+            bio.reset(new CNetBlockIO(4096, hostname, port, netconfig));
             status = CONNECTED;
             return true;
         } catch(...)
@@ -89,13 +89,13 @@ std::future<bool> CFSHandler::Decrypt(char *pass)
     std::future<bool> result( std::async([this, pass] {
         try
         {
-            enc.reset(new CEncrypt(*bio, pass));
-            cbio.reset(new CCacheIO(bio, *enc, false));
+            enc.reset(new CEncrypt(*bio, pass, cacheconfig.cryptthreads));
+            cbio.reset(new CCacheIO(bio, *enc, false, cacheconfig));
 
             switch(filesystemType)
             {
                 case SIMPLE:
-                    fs.reset(new CSimpleFilesystem(cbio));
+                    fs.reset(new CSimpleFilesystem(cbio, fsconfig));
                     break;
 
                 case CONTAINER:
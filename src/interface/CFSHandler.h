@@ -7,6 +7,7 @@
 #include"../IO/CEncrypt.h"
 #include"../IO/CCacheIO.h"
 #include"../FS/CFilesystem.h"
+#include"../FS/SimpleFS/CSimpleFS.h"
 
 enum HandlerStatus { DISCONNECTED, CONNECTED, UNMOUNTED, MOUNTED };
 
@@ -20,6 +21,9 @@ class CFSHandler
     std::shared_ptr<CEncrypt> enc;
     std::shared_ptr<CCacheIO> cbio;
     CFilesystemPtr fs;
+    CCacheConfig cacheconfig;
+    CNetConfig netconfig;
+    CSimpleFSConfig fsconfig;
 
     std::future<bool> ConnectNET(const std::string hostname, const std::string port);
     std::future<bool> ConnectRAM();
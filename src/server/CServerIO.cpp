@@ -0,0 +1,708 @@
+#include "CServerIO.h"
+#include "Logger.h"
+
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef HAVE_LIBURING
+// one submission, or the remainder of a short one
+class CUringOp
+{
+public:
+    std::shared_ptr<CServerIORequest> request;
+    int64_t done;
+};
+#endif
+
+CServerIO::CServerIO(const std::string &filename, const CServerIOConfig &_config) : config(_config)
+{
+    fd = open(filename.c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        LOG(LogLevel::ERR) << "Cannot open file '" << filename << "': " << strerror(errno);
+        throw std::exception();
+    }
+
+    if (config.direct)
+    {
+#ifdef O_DIRECT
+        fddirect = open(filename.c_str(), O_RDWR | O_DIRECT);
+        if (fddirect < 0)
+        {
+            LOG(LogLevel::WARN) << "O_DIRECT not supported: " << strerror(errno) << ". Use buffered I/O";
+        }
+#else
+        LOG(LogLevel::WARN) << "O_DIRECT not supported on this platform. Use buffered I/O";
+#endif
+    }
+
+#ifdef HAVE_LIBURING
+    if (config.uring)
+    {
+        int ret = io_uring_queue_init(URINGDEPTH, &ring, 0);
+        if (ret < 0)
+        {
+            LOG(LogLevel::WARN) << "io_uring not available: " << strerror(-ret) << ". Use worker threads";
+        } else
+        {
+            useuring = true;
+            uringthread = std::thread(&CServerIO::UringThread, this);
+        }
+    }
+#else
+    if (config.uring)
+    {
+        LOG(LogLevel::WARN) << "Compiled without io_uring support. Use worker threads";
+    }
+#endif
+
+    maxcacheblocks = std::max<int64_t>(config.cachesize, 0) / ALIGNMENT;
+    if (maxcacheblocks > 0)
+    {
+        LOG(LogLevel::INFO) << "Block cache of " << (maxcacheblocks*ALIGNMENT>>20) << " MB";
+    }
+
+    // also needed with io_uring for requests O_DIRECT cannot handle
+    int nthreads = std::max(config.nthreads, 1);
+    for(int i=0; i<nthreads; i++)
+    {
+        workers.emplace_back(&CServerIO::WorkerThread, this);
+    }
+    syncthread = std::thread(&CServerIO::SyncThread, this);
+}
+
+CServerIO::~CServerIO()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        terminate = true;
+    }
+    cond.notify_all();
+    for(auto &t : workers) t.join();
+
+#ifdef HAVE_LIBURING
+    if (useuring)
+    {
+        {
+            // a nop without user data stops the completion thread
+            std::lock_guard<std::mutex> lock(uringmutex);
+            struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+            while (sqe == nullptr)
+            {
+                io_uring_submit(&ring);
+                sqe = io_uring_get_sqe(&ring);
+            }
+            io_uring_prep_nop(sqe);
+            io_uring_sqe_set_data(sqe, nullptr);
+            io_uring_submit(&ring);
+        }
+        uringthread.join();
+        io_uring_queue_exit(&ring);
+    }
+#endif
+
+    {
+        std::lock_guard<std::mutex> lock(syncmtx);
+        terminatesync = true;
+    }
+    synccond.notify_all();
+    syncthread.join();
+
+    if (fddirect >= 0) close(fddirect);
+    close(fd);
+}
+
+int8_t* CServerIO::AllocAligned(int64_t size)
+{
+    void *d = nullptr;
+    if (posix_memalign(&d, ALIGNMENT, size) != 0) throw std::bad_alloc();
+    return (int8_t*)d;
+}
+
+void CServerIO::FreeAligned(int8_t *d)
+{
+    free(d);
+}
+
+int64_t CServerIO::GetFilesize()
+{
+    struct stat st{};
+    if (fstat(fd, &st) != 0)
+    {
+        LOG(LogLevel::ERR) << "Cannot stat container: " << strerror(errno);
+        throw std::exception();
+    }
+    return st.st_size;
+}
+
+void CServerIO::LogStats()
+{
+    int64_t reads = nreads.exchange(0);
+    int64_t hits = nhits.exchange(0);
+    int64_t diskreads = ndiskreads.exchange(0);
+    int64_t coalesced = ncoalesced.exchange(0);
+    int64_t readaheads = nreadaheads.exchange(0);
+    int64_t syncs = nsyncs.exchange(0);
+    int64_t discarded = ndiscarded.exchange(0);
+    if ((reads == 0) && (syncs == 0) && (discarded == 0)) return;
+
+    size_t ncached;
+    {
+        std::lock_guard<std::mutex> lock(cachemtx);
+        ncached = lru.size();
+    }
+    LOG(LogLevel::INFO) << "Reads: " << reads
+        << ", cache hits: " << hits << " (" << (reads?(hits*100/reads):0) << "%)"
+        << ", disk reads: " << diskreads
+        << ", coalesced: " << coalesced
+        << ", readahead hints: " << readaheads
+        << ", cached blocks: " << ncached
+        << ", syncs: " << syncs
+        << ", discarded: " << (discarded>>20) << " MB";
+}
+
+bool CServerIO::IsDirect(const CServerIORequest &request, bool checkbuffer) const
+{
+    if (fddirect < 0) return false;
+    if ((request.offset % ALIGNMENT) != 0) return false;
+    if ((request.length % ALIGNMENT) != 0) return false;
+    if (checkbuffer && (((uintptr_t)request.data) % ALIGNMENT) != 0) return false;
+    return true;
+}
+
+void CServerIO::Submit(CServerIORequest::TYPE type, int64_t offset, int64_t length, int8_t *data, std::function<void(bool)> done)
+{
+    auto request = std::make_shared<CServerIORequest>();
+    request->type = type;
+    request->offset = offset;
+    request->length = length;
+    request->data = data;
+    request->done = std::move(done);
+    if (type == CServerIORequest::TYPE::read) nreads++;
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto &r : inflight)
+        {
+            // a flush waits for all earlier writes, but nothing waits for a flush
+            if (type == CServerIORequest::TYPE::flush)
+            {
+                if (r->type == CServerIORequest::TYPE::read) continue;
+                if (r->type == CServerIORequest::TYPE::flush) continue;
+                r->blocked.push_back(request);
+                request->nwaiting++;
+                continue;
+            }
+            if (r->type == CServerIORequest::TYPE::flush) continue;
+            if (r->offset >= offset+length) continue;
+            if (offset >= r->offset+r->length) continue;
+            if ((r->type == CServerIORequest::TYPE::read) && (type == CServerIORequest::TYPE::read)) continue;
+            r->blocked.push_back(request);
+            request->nwaiting++;
+        }
+        inflight.push_back(request);
+        if (request->nwaiting > 0) return;
+    }
+    Dispatch(request);
+}
+
+void CServerIO::Dispatch(const std::shared_ptr<CServerIORequest> &request)
+{
+    if (request->type == CServerIORequest::TYPE::flush)
+    {
+        WhenSynced([this, request](bool ok) { Complete(request, ok); });
+        return;
+    }
+
+    // all earlier writes to this range have completed, so the cache is up to date
+    if (request->type == CServerIORequest::TYPE::read)
+    {
+        if (ReadCached(*request))
+        {
+            Complete(request, true);
+            return;
+        }
+        if (fddirect < 0) Readahead(*request);
+    }
+
+#ifdef HAVE_LIBURING
+    if (useuring && (request->type != CServerIORequest::TYPE::discard) && ((fddirect < 0) || IsDirect(*request, true)))
+    {
+        if (SubmitUring(request, 0)) return;
+    }
+#endif
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(request);
+    }
+    cond.notify_one();
+}
+
+void CServerIO::Complete(const std::shared_ptr<CServerIORequest> &request, bool ok)
+{
+    // before the request leaves inflight, so that no later overlapping read or write runs
+    // until the cache reflects it
+    if (!request->fromcache) UpdateCache(*request, ok);
+
+    std::vector<std::shared_ptr<CServerIORequest>> ready;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for(auto it = inflight.begin(); it != inflight.end(); ++it)
+        {
+            if (*it != request) continue;
+            inflight.erase(it);
+            break;
+        }
+        for(auto &r : request->blocked)
+        {
+            if (--r->nwaiting == 0) ready.push_back(r);
+        }
+        request->blocked.clear();
+    }
+    for(auto &r : ready) Dispatch(r);
+
+    // in async mode the container is only synced on a flush
+    if (ok && (request->type == CServerIORequest::TYPE::write) && (config.syncmode != CServerIOConfig::SYNCMODE::async))
+    {
+        bool wait = (config.syncmode == CServerIOConfig::SYNCMODE::write);
+        std::lock_guard<std::mutex> lock(syncmtx);
+        unsyncedbytes += request->length;
+        if (wait) syncwaiters.push_back([request](bool synced) { request->done(synced); });
+        if (wait || (unsyncedbytes >= config.syncbytes)) synccond.notify_one();
+        if (wait) return;
+    }
+    request->done(ok);
+}
+
+void CServerIO::WhenSynced(std::function<void(bool)> f)
+{
+    {
+        std::lock_guard<std::mutex> lock(syncmtx);
+        syncwaiters.push_back(std::move(f));
+    }
+    synccond.notify_one();
+}
+
+// Whoever arrives during an fdatasync waits for the next one. In group mode the writes
+// are collected until the interval or the amount of unsynced data is reached. An explicit
+// flush syncs at once together with everything collected so far.
+void CServerIO::SyncThread()
+{
+    std::unique_lock<std::mutex> lock(syncmtx);
+    for(;;)
+    {
+        if (config.syncmode == CServerIOConfig::SYNCMODE::group)
+        {
+            synccond.wait_for(lock, std::chrono::milliseconds(config.syncinterval),
+                [this]{ return terminatesync || !syncwaiters.empty() || (unsyncedbytes >= config.syncbytes); });
+        } else
+        {
+            synccond.wait(lock, [this]{ return terminatesync || !syncwaiters.empty(); });
+        }
+        if (syncwaiters.empty() && (unsyncedbytes == 0))
+        {
+            if (terminatesync) return;
+            continue;
+        }
+
+        std::vector<std::function<void(bool)>> waiters;
+        waiters.swap(syncwaiters);
+        unsyncedbytes = 0;
+        lock.unlock();
+
+        bool ok = (fdatasync(fd) == 0);
+        if (!ok)
+        {
+            LOG(LogLevel::ERR) << "Cannot sync container: " << strerror(errno);
+        }
+        nsyncs++;
+        for(auto &f : waiters) f(ok);
+
+        lock.lock();
+    }
+}
+
+// Finishes the request synchronously, starting at byte "done"
+bool CServerIO::Transfer(CServerIORequest &request, int64_t done)
+{
+    if (request.type == CServerIORequest::TYPE::discard) return Discard(request);
+
+    bool direct = IsDirect(request, false);
+    int usedfd = direct?fddirect:fd;
+
+    // O_DIRECT also needs an aligned buffer
+    int8_t *bounce = nullptr;
+    int8_t *d = request.data;
+    if (direct && ((((uintptr_t)request.data) % ALIGNMENT) != 0))
+    {
+        bounce = AllocAligned(request.length);
+        d = bounce;
+        if (request.type == CServerIORequest::TYPE::write) memcpy(bounce, request.data, request.length);
+    }
+
+    if (request.type == CServerIORequest::TYPE::read) ndiskreads++;
+
+    bool ok = true;
+    while(done < request.length)
+    {
+        ssize_t ret;
+        if (request.type == CServerIORequest::TYPE::read)
+            ret = pread(usedfd, d+done, request.length-done, request.offset+done);
+        else
+            ret = pwrite(usedfd, d+done, request.length-done, request.offset+done);
+
+        if (ret < 0)
+        {
+            if (errno == EINTR) continue;
+            LOG(LogLevel::ERR) << "Cannot " << ((request.type == CServerIORequest::TYPE::read)?"read ":"write ")
+                << request.length << " bytes at offset " << request.offset << ": " << strerror(errno);
+            ok = false;
+            break;
+        }
+        if (ret == 0)
+        {
+            if (request.type == CServerIORequest::TYPE::write)
+            {
+                LOG(LogLevel::ERR) << "Cannot write " << request.length << " bytes into container";
+                ok = false;
+                break;
+            }
+            LOG(LogLevel::WARN) << "Read outside of file boundary";
+            memset(d+done, 0, request.length-done);
+            break;
+        }
+        done += ret;
+    }
+
+    if (bounce != nullptr)
+    {
+        if (ok && (request.type == CServerIORequest::TYPE::read)) memcpy(request.data, bounce, request.length);
+        FreeAligned(bounce);
+    }
+    return ok;
+}
+
+// Punches a hole into the file. Without support by the file system the data simply stays.
+bool CServerIO::Discard(const CServerIORequest &request)
+{
+    if (!candiscard.load() || (request.length == 0)) return true;
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+    int ret;
+    do
+    {
+        ret = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, request.offset, request.length);
+    } while((ret < 0) && (errno == EINTR));
+    if (ret == 0)
+    {
+        ndiscarded += request.length;
+        return true;
+    }
+    if ((errno != EOPNOTSUPP) && (errno != ENOSYS))
+    {
+        LOG(LogLevel::ERR) << "Cannot discard " << request.length << " bytes at offset " << request.offset << ": " << strerror(errno);
+        return false;
+    }
+#endif
+    if (candiscard.exchange(false))
+    {
+        LOG(LogLevel::WARN) << "Discard not supported by the container file. The space is not released";
+    }
+    return true;
+}
+
+void CServerIO::WorkerThread()
+{
+    for(;;)
+    {
+        std::vector<std::shared_ptr<CServerIORequest>> requests;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cond.wait(lock, [&]{return terminate || !queue.empty();});
+            if (queue.empty()) return;
+            requests.push_back(queue.front());
+            queue.pop_front();
+            CollectAdjacent(requests);
+        }
+        if (requests.size() > 1)
+        {
+            TransferCoalesced(requests);
+            continue;
+        }
+        bool ok = Transfer(*requests[0], 0);
+        Complete(requests[0], ok);
+    }
+}
+
+// Takes queued reads from the queue which extend the read in requests at either side.
+// Must be called with the mutex held.
+void CServerIO::CollectAdjacent(std::vector<std::shared_ptr<CServerIORequest>> &requests)
+{
+    const CServerIORequest &first = *requests[0];
+    if (first.type != CServerIORequest::TYPE::read) return;
+
+    // with O_DIRECT all parts must go to the same descriptor without a bounce buffer
+    bool direct = IsDirect(first, false);
+    if (direct != IsDirect(first, true)) return;
+
+    int64_t begin = first.offset;
+    int64_t end = first.offset + first.length;
+    bool found = true;
+    while(found && (requests.size() < MAXCOALESCE))
+    {
+        found = false;
+        for(auto it = queue.begin(); it != queue.end(); ++it)
+        {
+            const CServerIORequest &r = **it;
+            if (r.type != CServerIORequest::TYPE::read) continue;
+            if (r.length <= 0) continue;
+            if (end - begin + r.length > MAXCOALESCEBYTES) continue;
+            if ((IsDirect(r, false) != direct) || (IsDirect(r, true) != direct)) continue;
+            if (r.offset == end)
+                end += r.length;
+            else if (r.offset + r.length == begin)
+                begin = r.offset;
+            else
+                continue;
+            requests.push_back(*it);
+            queue.erase(it);
+            found = true;
+            break;
+        }
+    }
+}
+
+// One preadv for adjacent reads. Anything unusual is left to Transfer.
+void CServerIO::TransferCoalesced(std::vector<std::shared_ptr<CServerIORequest>> &requests)
+{
+    std::sort(requests.begin(), requests.end(),
+        [](const std::shared_ptr<CServerIORequest> &a, const std::shared_ptr<CServerIORequest> &b)
+        {
+            return a->offset < b->offset;
+        });
+
+    std::vector<struct iovec> iov(requests.size());
+    int64_t length = 0;
+    for(size_t i=0; i<requests.size(); i++)
+    {
+        iov[i].iov_base = requests[i]->data;
+        iov[i].iov_len = requests[i]->length;
+        length += requests[i]->length;
+    }
+    int usedfd = IsDirect(*requests[0], false)?fddirect:fd;
+
+    ndiskreads++;
+    ncoalesced += requests.size()-1;
+    ssize_t ret;
+    do
+    {
+        ret = preadv(usedfd, iov.data(), iov.size(), requests[0]->offset);
+    } while((ret < 0) && (errno == EINTR));
+
+    for(auto &r : requests)
+    {
+        bool ok = (ret == length) || Transfer(*r, 0);
+        Complete(r, ok);
+    }
+}
+
+bool CServerIO::ReadCached(CServerIORequest &request)
+{
+    if (maxcacheblocks == 0) return false;
+    if (((request.offset % ALIGNMENT) != 0) || ((request.length % ALIGNMENT) != 0)) return false;
+    if (request.length <= 0) return false;
+
+    int64_t first = request.offset / ALIGNMENT;
+    int64_t n = request.length / ALIGNMENT;
+    std::lock_guard<std::mutex> lock(cachemtx);
+    for(int64_t i=0; i<n; i++)
+    {
+        if (cacheidx.find(first+i) == cacheidx.end()) return false;
+    }
+    for(int64_t i=0; i<n; i++)
+    {
+        auto it = cacheidx[first+i];
+        memcpy(request.data + i*ALIGNMENT, it->second.get(), ALIGNMENT);
+        lru.splice(lru.begin(), lru, it);
+    }
+    request.fromcache = true;
+    nhits++;
+    return true;
+}
+
+void CServerIO::UpdateCache(const CServerIORequest &request, bool ok)
+{
+    if (maxcacheblocks == 0) return;
+    if (request.type == CServerIORequest::TYPE::flush) return;
+    if (request.length <= 0) return;
+
+    int64_t first = request.offset / ALIGNMENT;
+    int64_t last = (request.offset + request.length - 1) / ALIGNMENT;
+    bool aligned = ((request.offset % ALIGNMENT) == 0) && ((request.length % ALIGNMENT) == 0);
+
+    std::lock_guard<std::mutex> lock(cachemtx);
+    if ((request.type == CServerIORequest::TYPE::discard) && ((size_t)(last-first+1) > lru.size()))
+    {
+        // large discards look at the cached blocks instead
+        for(auto it = lru.begin(); it != lru.end();)
+        {
+            if ((it->first < first) || (it->first > last))
+            {
+                ++it;
+                continue;
+            }
+            cacheidx.erase(it->first);
+            it = lru.erase(it);
+        }
+        return;
+    }
+    for(int64_t blockidx=first; blockidx<=last; blockidx++)
+    {
+        auto it = cacheidx.find(blockidx);
+        if (request.type != CServerIORequest::TYPE::read)
+        {
+            if (it == cacheidx.end()) continue;
+            if (!ok || !aligned || (request.type == CServerIORequest::TYPE::discard))
+            {
+                // partially written and discarded blocks are read again from the disk
+                lru.erase(it->second);
+                cacheidx.erase(it);
+                continue;
+            }
+            memcpy(it->second->second.get(), request.data + (blockidx-first)*ALIGNMENT, ALIGNMENT);
+            lru.splice(lru.begin(), lru, it->second);
+            continue;
+        }
+
+        if (!ok || !aligned) return;
+        if (it != cacheidx.end())
+        {
+            lru.splice(lru.begin(), lru, it->second);
+            continue;
+        }
+        std::unique_ptr<int8_t[]> block;
+        if (lru.size() >= maxcacheblocks)
+        {
+            // reuse the memory of the least recently used block
+            block = std::move(lru.back().second);
+            cacheidx.erase(lru.back().first);
+            lru.pop_back();
+        } else
+        {
+            block.reset(new int8_t[ALIGNMENT]);
+        }
+        memcpy(block.get(), request.data + (blockidx-first)*ALIGNMENT, ALIGNMENT);
+        lru.emplace_front(blockidx, std::move(block));
+        cacheidx[blockidx] = lru.begin();
+    }
+}
+
+// Sequential streams are recognized by reads that start where an earlier one ended.
+// From the third read on the page cache is asked to fetch ahead of the stream.
+void CServerIO::Readahead(const CServerIORequest &request)
+{
+    int64_t end = request.offset + request.length;
+    int64_t hintofs = 0;
+    int64_t hintlen = 0;
+    {
+        std::lock_guard<std::mutex> lock(streammtx);
+        streamclock++;
+        CStream *stream = nullptr;
+        for(auto &s : streams)
+        {
+            if (s.next == request.offset) stream = &s;
+        }
+        if (stream == nullptr)
+        {
+            stream = &*std::min_element(streams.begin(), streams.end(),
+                [](const CStream &a, const CStream &b) { return a.lastuse < b.lastuse; });
+            stream->nsequential = 0;
+            stream->hinted = 0;
+        } else
+        {
+            stream->nsequential++;
+        }
+        stream->next = end;
+        stream->lastuse = streamclock;
+        if ((stream->nsequential >= 2) && (stream->hinted < end + READAHEADSIZE/2))
+        {
+            hintofs = std::max(stream->hinted, end);
+            hintlen = end + READAHEADSIZE - hintofs;
+            stream->hinted = end + READAHEADSIZE;
+        }
+    }
+    if (hintlen <= 0) return;
+    nreadaheads++;
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(fd, hintofs, hintlen, POSIX_FADV_WILLNEED);
+#endif
+}
+
+#ifdef HAVE_LIBURING
+bool CServerIO::SubmitUring(const std::shared_ptr<CServerIORequest> &request, int64_t done)
+{
+    std::lock_guard<std::mutex> lock(uringmutex);
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
+    if (sqe == nullptr)
+    {
+        io_uring_submit(&ring);
+        sqe = io_uring_get_sqe(&ring);
+        if (sqe == nullptr) return false;
+    }
+    int usedfd = (fddirect >= 0)?fddirect:fd;
+    if ((request->type == CServerIORequest::TYPE::read) && (done == 0)) ndiskreads++;
+    if (request->type == CServerIORequest::TYPE::read)
+        io_uring_prep_read(sqe, usedfd, request->data+done, request->length-done, request->offset+done);
+    else
+        io_uring_prep_write(sqe, usedfd, request->data+done, request->length-done, request->offset+done);
+    io_uring_sqe_set_data(sqe, new CUringOp{request, done});
+    io_uring_submit(&ring);
+    return true;
+}
+
+void CServerIO::UringThread()
+{
+    for(;;)
+    {
+        struct io_uring_cqe *cqe = nullptr;
+        int ret = io_uring_wait_cqe(&ring, &cqe);
+        if (ret == -EINTR) continue;
+        if (ret < 0)
+        {
+            LOG(LogLevel::ERR) << "io_uring_wait_cqe failed: " << strerror(-ret);
+            return;
+        }
+        auto *op = (CUringOp*)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&ring, cqe);
+        if (op == nullptr) return;
+
+        std::shared_ptr<CServerIORequest> request = std::move(op->request);
+        int64_t done = op->done;
+        delete op;
+
+        if ((res < 0) && (res != -EAGAIN) && (res != -EINTR))
+        {
+            LOG(LogLevel::ERR) << "Cannot " << ((request->type == CServerIORequest::TYPE::read)?"read ":"write ")
+                << request->length << " bytes at offset " << request->offset << ": " << strerror(-res);
+            Complete(request, false);
+            continue;
+        }
+        if (res > 0) done += res;
+        if (done == request->length)
+        {
+            Complete(request, true);
+            continue;
+        }
+        // short transfer or end of file. The synchronous path handles both.
+        if ((res > 0) && SubmitUring(request, done)) continue;
+        Complete(request, Transfer(*request, done));
+    }
+}
+#endif
@@ -0,0 +1,161 @@
+#ifndef CSERVERIO_H
+#define CSERVERIO_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <array>
+#include <atomic>
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <functional>
+#include <condition_variable>
+
+#include "config.h"
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+class CServerIOConfig
+{
+public:
+    // When written data reaches stable storage besides on FLUSH. async: never,
+    // group: every syncinterval ms or syncbytes, write: before a write completes
+    enum class SYNCMODE {async, group, write};
+
+    int nthreads = 4;    // disk workers, so a slow request does not stall the others
+    bool direct = false; // bypass the page cache with O_DIRECT where the request is aligned
+    bool uring = false;  // use io_uring if it was compiled in and the kernel supports it
+    int64_t cachesize = 0; // bytes of the block cache. 0 = no cache
+    SYNCMODE syncmode = SYNCMODE::async;
+    int syncinterval = 100; // in ms
+    int64_t syncbytes = 64*1024*1024;
+};
+
+class CServerIORequest
+{
+public:
+    // a flush completes when all earlier writes are on stable storage. A discard is
+    // ordered like a write and releases the range in the file, which then reads as zeros.
+    enum class TYPE {read, write, flush, discard};
+
+    TYPE type;
+    int64_t offset;
+    int64_t length;
+    int8_t *data;                    // must stay valid until done is called
+    std::function<void(bool)> done;  // called from an engine thread
+
+private:
+    friend class CServerIO;
+    int nwaiting = 0; // earlier overlapping requests that must complete first
+    bool fromcache = false;
+    std::vector<std::shared_ptr<CServerIORequest>> blocked;
+};
+
+// Positional I/O on the container file. Requests run concurrently, except that a request
+// waits for all earlier requests that overlap it if one of them is a write.
+class CServerIO
+{
+public:
+    static const int ALIGNMENT = 4096;
+
+    CServerIO(const std::string &filename, const CServerIOConfig &config);
+    ~CServerIO();
+
+    void Submit(CServerIORequest::TYPE type, int64_t offset, int64_t length, int8_t *data, std::function<void(bool)> done);
+    int64_t GetFilesize();
+    void LogStats(); // since the last call
+
+    // Buffers from here are aligned for O_DIRECT
+    static int8_t* AllocAligned(int64_t size);
+    static void FreeAligned(int8_t *d);
+
+private:
+    void Dispatch(const std::shared_ptr<CServerIORequest> &request);
+    void Complete(const std::shared_ptr<CServerIORequest> &request, bool ok);
+    bool Transfer(CServerIORequest &request, int64_t done);
+    bool IsDirect(const CServerIORequest &request, bool checkbuffer) const;
+    bool Discard(const CServerIORequest &request);
+    void WorkerThread();
+
+    // Reads in the queue which are adjacent on disk are done with one preadv
+    void CollectAdjacent(std::vector<std::shared_ptr<CServerIORequest>> &requests);
+    void TransferCoalesced(std::vector<std::shared_ptr<CServerIORequest>> &requests);
+    static const size_t MAXCOALESCE = 64; // requests per disk read
+    static const int64_t MAXCOALESCEBYTES = 4*1024*1024;
+
+    // Block cache of whole aligned blocks in LRU order. Blocks enter it when they are read
+    // and are updated by writes.
+    bool ReadCached(CServerIORequest &request);
+    void UpdateCache(const CServerIORequest &request, bool ok);
+    std::mutex cachemtx;
+    std::list<std::pair<int64_t, std::unique_ptr<int8_t[]>>> lru; // block index and content
+    std::unordered_map<int64_t, std::list<std::pair<int64_t, std::unique_ptr<int8_t[]>>>::iterator> cacheidx;
+    size_t maxcacheblocks = 0;
+
+    // Sequential read streams, which get readahead hints for the page cache
+    class CStream
+    {
+    public:
+        int64_t next = -1; // expected offset of the next read
+        int64_t hinted = 0; // end of the readahead hint
+        int nsequential = 0;
+        uint64_t lastuse = 0;
+    };
+    void Readahead(const CServerIORequest &request);
+    static const int NSTREAMS = 8;
+    static const int64_t READAHEADSIZE = 1024*1024;
+    std::mutex streammtx;
+    std::array<CStream, NSTREAMS> streams;
+    uint64_t streamclock = 0;
+
+    std::atomic<int64_t> nreads{0};
+    std::atomic<int64_t> nhits{0}; // reads served by the block cache
+    std::atomic<int64_t> ndiskreads{0};
+    std::atomic<int64_t> ncoalesced{0}; // reads merged into the disk read of another one
+    std::atomic<int64_t> nreadaheads{0};
+    std::atomic<int64_t> nsyncs{0};
+    std::atomic<int64_t> ndiscarded{0}; // bytes
+    std::atomic<bool> candiscard{true};
+
+    // All fdatasync calls are made by the sync thread, so that everybody who waits at the
+    // same time shares one
+    void SyncThread();
+    void WhenSynced(std::function<void(bool)> f);
+    std::mutex syncmtx;
+    std::condition_variable synccond;
+    std::vector<std::function<void(bool)>> syncwaiters;
+    int64_t unsyncedbytes = 0;
+    bool terminatesync = false;
+    std::thread syncthread;
+
+    CServerIOConfig config;
+
+    int fd = -1;
+    int fddirect = -1;
+
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::list<std::shared_ptr<CServerIORequest>> inflight;
+    std::deque<std::shared_ptr<CServerIORequest>> queue;
+    std::vector<std::thread> workers;
+    bool terminate = false;
+
+#ifdef HAVE_LIBURING
+    bool SubmitUring(const std::shared_ptr<CServerIORequest> &request, int64_t done);
+    void UringThread();
+
+    static const int URINGDEPTH = 256;
+    struct io_uring ring;
+    bool useuring = false;
+    std::mutex uringmutex;
+    std::thread uringthread;
+#endif
+};
+
+#endif
@@ -0,0 +1,465 @@
+#include "CServerSession.h"
+#include "Logger.h"
+
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+
+CServerSession::CServerSession(boost::asio::io_service &io_service, boost::asio::ssl::context &ctx, CServerIO &_io)
+: rxbuf(RXBUFSIZE),
+  rxcmd{},
+  rxheaderlen(0),
+  rxpayload(nullptr),
+  rxpayloadsize(0),
+  rxpayloadlen(0),
+  rxinpayload(false),
+  npending(0),
+  pendingbytes(0),
+  paused(false),
+  txerror(false),
+  sock(io_service, ctx),
+  strand(io_service),
+  io(_io)
+{
+}
+
+CServerSession::~CServerSession()
+{
+    if (rxpayload != nullptr) CServerIO::FreeAligned(rxpayload);
+    for(auto *replybuf : txqueue) CServerIO::FreeAligned(replybuf);
+    for(auto *replybuf : txinflight) CServerIO::FreeAligned(replybuf);
+    LOG(LogLevel::INFO) << "Connection closed";
+}
+
+ssl_socket& CServerSession::GetSocket()
+{
+    return sock;
+}
+
+void CServerSession::Start()
+{
+    auto self = shared_from_this();
+    sock.async_handshake(boost::asio::ssl::stream_base::server, strand.wrap(
+    [self](const boost::system::error_code &ec)
+    {
+        if (ec)
+        {
+            LOG(LogLevel::ERR) << "SSL handshake failed: " << ec.message();
+            return;
+        }
+        self->AsyncRead();
+    }));
+}
+
+void CServerSession::Fail(const std::string &error)
+{
+    LOG(LogLevel::ERR) << "Exception in session: " << error;
+    boost::system::error_code ec;
+    sock.lowest_layer().close(ec);
+}
+
+void CServerSession::AsyncRead()
+{
+    auto self = shared_from_this();
+    if (rxinpayload && ((size_t)(rxpayloadsize-rxpayloadlen) >= RXBUFSIZE))
+    {
+        sock.async_read_some(
+        boost::asio::buffer(rxpayload+rxpayloadlen, rxpayloadsize-rxpayloadlen), strand.wrap(
+        [self](const boost::system::error_code& ec, std::size_t readbytes)
+        {
+            if (ec) return; // connection closed
+            self->rxpayloadlen += readbytes;
+            self->Received(nullptr, 0);
+        }));
+        return;
+    }
+
+    sock.async_read_some(
+    boost::asio::buffer(rxbuf.data(), rxbuf.size()), strand.wrap(
+    [self](const boost::system::error_code& ec, std::size_t readbytes)
+    {
+        if (ec) return; // connection closed
+        self->Received(self->rxbuf.data(), readbytes);
+    }));
+}
+
+// Parses the received bytes and reads on unless the session failed or too much is pending
+void CServerSession::Received(const int8_t *d, size_t n)
+{
+    try
+    {
+        Parse(d, n);
+    } catch(std::exception &e)
+    {
+        Fail(e.what());
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pendingmtx);
+        if (pendingbytes >= MAXPENDINGBYTES)
+        {
+            paused = true;
+            return;
+        }
+    }
+    AsyncRead();
+}
+
+// Splits the stream into commands. Only the write payloads are copied, into their own buffer
+void CServerSession::Parse(const int8_t *d, size_t n)
+{
+    for(;;)
+    {
+        if (rxinpayload)
+        {
+            size_t size = std::min<int64_t>(n, rxpayloadsize-rxpayloadlen);
+            if (size > 0) memcpy(rxpayload+rxpayloadlen, d, size);
+            rxpayloadlen += size;
+            d += size;
+            n -= size;
+            if (rxpayloadlen < rxpayloadsize) return;
+            rxinpayload = false;
+            Execute();
+        }
+        if (n == 0) return;
+        if (rxheaderlen == 0) memset(&rxcmd, 0, sizeof(rxcmd));
+
+        // the length first, because short commands consist of the command number only
+        size_t headersize = (rxheaderlen < 4)?4:std::min<size_t>(rxcmd.cmdlen, HEADERSIZE);
+        size_t size = std::min(n, headersize-rxheaderlen);
+        memcpy((int8_t*)&rxcmd+rxheaderlen, d, size);
+        rxheaderlen += size;
+        d += size;
+        n -= size;
+        if (rxheaderlen < headersize) return;
+        if (rxheaderlen == 4)
+        {
+            if ((rxcmd.cmdlen < SHORTHEADERSIZE) || (rxcmd.cmdlen > MAXCOMMANDSIZE))
+                throw std::runtime_error("Command with invalid length " + std::to_string(rxcmd.cmdlen));
+            continue;
+        }
+        rxheaderlen = 0;
+
+        LOG(LogLevel::DEBUG) << "received command " << rxcmd.cmd << " with len=" << rxcmd.cmdlen;
+        auto command = (COMMAND)rxcmd.cmd;
+        if ((command == COMMAND::WRITE) || (command == COMMAND::READV) || (command == COMMAND::WRITEV) || (command == COMMAND::DISCARD))
+        {
+            // the extent table of vectored commands precedes the data
+            int64_t tablesize = (command == COMMAND::WRITE)?0:(int64_t)rxcmd.dummy*16;
+            int64_t datasize = ((command == COMMAND::WRITE) || (command == COMMAND::WRITEV))?rxcmd.length:0;
+            if ((rxcmd.cmdlen < (int32_t)HEADERSIZE) || (rxcmd.cmdlen-(int32_t)HEADERSIZE != tablesize+datasize))
+                throw std::runtime_error("Command with invalid length " + std::to_string(rxcmd.cmdlen));
+            if ((command != COMMAND::WRITE) && ((rxcmd.dummy < 1) || (rxcmd.dummy > MAXEXTENTS)))
+                throw std::runtime_error("Vectored command with " + std::to_string(rxcmd.dummy) + " extents");
+            rxpayloadsize = tablesize+datasize;
+            rxpayload = CServerIO::AllocAligned(std::max<int64_t>(rxpayloadsize, 1));
+            rxpayloadlen = 0;
+            rxinpayload = true;
+            continue;
+        }
+        // Commands without payload. Any other length would desync the stream or leave
+        // the header half filled. Only a read needs the offset and length.
+        if ((rxcmd.cmdlen != (int32_t)HEADERSIZE) && ((command == COMMAND::READ) || (rxcmd.cmdlen != SHORTHEADERSIZE)))
+            throw std::runtime_error("Command with invalid length " + std::to_string(rxcmd.cmdlen));
+        Execute();
+    }
+}
+
+// The header of rxcmd is complete, and for writes also rxpayload
+void CServerSession::Execute()
+{
+    auto self = shared_from_this();
+    int32_t id = rxcmd.id;
+
+    switch((COMMAND)rxcmd.cmd)
+    {
+    case COMMAND::READ:
+        {
+            //printf("READ ofs=%li size=%li (block: %li)\n", rxcmd.offset, rxcmd.length, rxcmd.offset/4096);
+            int64_t length = rxcmd.length;
+            if ((length < 0) || (length > MAXCOMMANDSIZE))
+                throw std::runtime_error("Read command with invalid length " + std::to_string(length));
+            int8_t *replybuf = AllocReply(id, length);
+            Started(length);
+            io.Submit(CServerIORequest::TYPE::read, rxcmd.offset, length, replybuf + CServerIO::ALIGNMENT,
+                [self, replybuf, length](bool ok)
+                {
+                    self->Finished(replybuf, length, ok);
+                });
+            break;
+        }
+    case COMMAND::WRITE:
+        {
+            //printf("WRITE ofs=%li size=%li (block: %li)\n", rxcmd.offset, rxcmd.length, rxcmd.offset/4096);
+            int8_t *payload = rxpayload;
+            int64_t length = rxcmd.length;
+            rxpayload = nullptr;
+            Started(length);
+            io.Submit(CServerIORequest::TYPE::write, rxcmd.offset, length, payload,
+                [self, payload, length](bool ok)
+                {
+                    CServerIO::FreeAligned(payload);
+                    self->Finished(nullptr, length, ok);
+                });
+            break;
+        }
+    case COMMAND::SIZE:
+        {
+            //printf("SIZE\n");
+            WhenIdle([self, id]
+            {
+                int64_t filesize = self->io.GetFilesize();
+                int8_t *replybuf = AllocReply(id, 8);
+                memcpy(replybuf + CServerIO::ALIGNMENT, &filesize, 8);
+                self->Send(replybuf);
+            });
+            break;
+        }
+
+    case COMMAND::CONTAINERINFO:
+        {
+            //printf("INFO\n");
+            WhenIdle([self, id]
+            {
+                int8_t *replybuf = AllocReply(id, 36);
+                memset(replybuf + CServerIO::ALIGNMENT, 0, 36);
+                strncpy((char*)replybuf + CServerIO::ALIGNMENT, "CoverFS Server V 1.0", 32);
+                int32_t capabilities = CAPABILITY_VECTORED | CAPABILITY_FLUSH | CAPABILITY_DISCARD;
+                memcpy(replybuf + CServerIO::ALIGNMENT + 32, &capabilities, 4);
+                self->Send(replybuf);
+            });
+            break;
+        }
+
+    case COMMAND::CLOSE:
+        {
+            //printf("CLOSE\n");
+            WhenIdle([self, id]
+            {
+                self->Send(AllocReply(id, 0));
+            });
+            break;
+        }
+
+    case COMMAND::READV:
+    case COMMAND::WRITEV:
+        ExecuteVector();
+        break;
+
+    case COMMAND::DISCARD:
+        ExecuteDiscard();
+        break;
+
+    case COMMAND::FLUSH:
+        {
+            // the writes received before are already in the I/O engine
+            int8_t *replybuf = AllocReply(id, 0);
+            Started(0);
+            io.Submit(CServerIORequest::TYPE::flush, 0, 0, nullptr,
+                [self, replybuf](bool ok)
+                {
+                    self->Finished(replybuf, 0, ok);
+                });
+            break;
+        }
+
+    default:
+        throw std::runtime_error("Unknown command " + std::to_string(rxcmd.cmd));
+    }
+}
+
+// Every extent is a request of its own. The command completes with the last of them.
+void CServerSession::ExecuteVector()
+{
+    auto self = shared_from_this();
+    bool read = (COMMAND)rxcmd.cmd == COMMAND::READV;
+    int nextents = rxcmd.dummy;
+    int64_t length = rxcmd.length;
+    std::vector<int64_t> table(nextents*2);
+    memcpy(table.data(), rxpayload, nextents*16);
+
+    int64_t sum = 0;
+    for(int i=0; i<nextents; i++)
+    {
+        if ((table[i*2+1] < 0) || (table[i*2+1] > MAXCOMMANDSIZE))
+            throw std::runtime_error("Extent with invalid length " + std::to_string(table[i*2+1]));
+        sum += table[i*2+1];
+    }
+    if ((sum != length) || (length > MAXCOMMANDSIZE))
+        throw std::runtime_error("Vectored command with invalid length " + std::to_string(length));
+
+    int8_t *replybuf = nullptr;
+    int8_t *payload = rxpayload;
+    int8_t *d = payload + nextents*16;
+    if (read)
+    {
+        replybuf = AllocReply(rxcmd.id, length);
+        d = replybuf + CServerIO::ALIGNMENT;
+        CServerIO::FreeAligned(payload);
+        payload = nullptr;
+    }
+    rxpayload = nullptr;
+
+    struct CCountdown
+    {
+        std::atomic<int> remaining;
+        std::atomic<bool> ok;
+    };
+    auto countdown = std::make_shared<CCountdown>();
+    countdown->remaining = nextents;
+    countdown->ok = true;
+
+    Started(length);
+    for(int i=0; i<nextents; i++)
+    {
+        io.Submit(read?CServerIORequest::TYPE::read:CServerIORequest::TYPE::write, table[i*2], table[i*2+1], d,
+            [self, countdown, replybuf, payload, length](bool ok)
+            {
+                if (!ok) countdown->ok = false;
+                if (--countdown->remaining > 0) return;
+                if (payload != nullptr) CServerIO::FreeAligned(payload);
+                self->Finished(replybuf, length, countdown->ok);
+            });
+        d += table[i*2+1];
+    }
+}
+
+// Releases the extents in the container. The command has no data and no reply.
+void CServerSession::ExecuteDiscard()
+{
+    auto self = shared_from_this();
+    int nextents = rxcmd.dummy;
+    std::vector<int64_t> table(nextents*2);
+    memcpy(table.data(), rxpayload, nextents*16);
+    CServerIO::FreeAligned(rxpayload);
+    rxpayload = nullptr;
+
+    for(int i=0; i<nextents; i++)
+    {
+        if ((table[i*2] < 0) || (table[i*2+1] < 0))
+            throw std::runtime_error("Discard of invalid extent at " + std::to_string(table[i*2]));
+    }
+    for(int i=0; i<nextents; i++)
+    {
+        Started(0);
+        io.Submit(CServerIORequest::TYPE::discard, table[i*2], table[i*2+1], nullptr,
+            [self](bool ok)
+            {
+                self->Finished(nullptr, 0, ok);
+            });
+    }
+}
+
+// --------------------------------------------------------
+
+void CServerSession::Started(int64_t bytes)
+{
+    std::lock_guard<std::mutex> lock(pendingmtx);
+    npending++;
+    pendingbytes += bytes;
+}
+
+// Called from the I/O engine
+void CServerSession::Finished(int8_t *replybuf, int64_t bytes, bool ok)
+{
+    std::vector<std::function<void()>> ready;
+    bool resume = false;
+    {
+        std::lock_guard<std::mutex> lock(pendingmtx);
+        npending--;
+        pendingbytes -= bytes;
+        if (npending == 0) ready.swap(idle);
+        if (paused && (pendingbytes < MAXPENDINGBYTES))
+        {
+            paused = false;
+            resume = true;
+        }
+    }
+
+    auto self = shared_from_this();
+    if (!ok)
+    {
+        if (replybuf != nullptr) CServerIO::FreeAligned(replybuf);
+        strand.post([self]{ self->Fail("I/O error on container"); });
+        return;
+    }
+    if (replybuf != nullptr) Send(replybuf);
+    try
+    {
+        for(auto &f : ready) f();
+    } catch(std::exception &e)
+    {
+        strand.post([self]{ self->Fail("Cannot answer command"); });
+        return;
+    }
+    if (resume) strand.post([self]{ self->AsyncRead(); });
+}
+
+// size, info and close reflect all commands received before them
+void CServerSession::WhenIdle(std::function<void()> f)
+{
+    {
+        std::lock_guard<std::mutex> lock(pendingmtx);
+        if (npending > 0)
+        {
+            idle.push_back(std::move(f));
+            return;
+        }
+    }
+    f();
+}
+
+// --------------------------------------------------------
+
+int8_t* CServerSession::AllocReply(int32_t id, int64_t size)
+{
+    int8_t *replybuf = CServerIO::AllocAligned(CServerIO::ALIGNMENT + size);
+    auto *reply = (REPLYCOMMANDSTRUCT*)(replybuf + CServerIO::ALIGNMENT - 8);
+    reply->cmdlen = size+8;
+    reply->id = id;
+    return replybuf;
+}
+
+void CServerSession::Send(int8_t *replybuf)
+{
+    auto self = shared_from_this();
+    strand.dispatch([self, replybuf]
+    {
+        if (self->txerror)
+        {
+            CServerIO::FreeAligned(replybuf);
+            return;
+        }
+        self->txqueue.push_back(replybuf);
+        if (self->txinflight.empty()) self->AsyncWrite();
+    });
+}
+
+void CServerSession::AsyncWrite()
+{
+    std::vector<boost::asio::const_buffer> buffers;
+    while(!txqueue.empty() && (txinflight.size() < MAXGATHER))
+    {
+        int8_t *replybuf = txqueue.front();
+        txqueue.pop_front();
+        auto *reply = (REPLYCOMMANDSTRUCT*)(replybuf + CServerIO::ALIGNMENT - 8);
+        buffers.emplace_back(reply, reply->cmdlen);
+        txinflight.push_back(replybuf);
+    }
+
+    auto self = shared_from_this();
+    boost::asio::async_write(sock, buffers, strand.wrap(
+    [self](const boost::system::error_code& ec, std::size_t)
+    {
+        for(auto *replybuf : self->txinflight) CServerIO::FreeAligned(replybuf);
+        self->txinflight.clear();
+        if (ec)
+        {
+            self->txerror = true;
+            for(auto *replybuf : self->txqueue) CServerIO::FreeAligned(replybuf);
+            self->txqueue.clear();
+            return;
+        }
+        if (!self->txqueue.empty()) self->AsyncWrite();
+    }));
+}
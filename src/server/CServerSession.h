@@ -0,0 +1,97 @@
+#ifndef CSERVERSESSION_H
+#define CSERVERSESSION_H
+
+#include <cstdint>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <boost/asio.hpp>
+#include <boost/asio/ssl.hpp>
+
+#include "CServerIO.h"
+#include "NetProtocol.h"
+
+typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
+
+typedef struct
+{
+    int32_t cmdlen;
+    int32_t id;
+    int32_t cmd;
+    int32_t dummy;
+    int64_t offset;
+    int64_t length;
+    int64_t data;
+} COMMANDSTRUCT;
+
+typedef struct
+{
+    int32_t cmdlen;
+    int32_t id;
+    int8_t data;
+} REPLYCOMMANDSTRUCT;
+
+// One client connection. All socket operations and the receive state run on the strand,
+// so several io threads can serve the connections. Commands are submitted to the I/O
+// engine as soon as they are parsed, and the replies are sent in completion order.
+class CServerSession : public std::enable_shared_from_this<CServerSession>
+{
+public:
+    CServerSession(boost::asio::io_service &io_service, boost::asio::ssl::context &ctx, CServerIO &_io);
+    ~CServerSession();
+
+    ssl_socket& GetSocket();
+    void Start();
+
+private:
+    // for reading. Headers are parsed from large chunks, write payloads of at least
+    // RXBUFSIZE are read directly into their buffer
+    void AsyncRead();
+    void Received(const int8_t *d, size_t n);
+    void Parse(const int8_t *d, size_t n);
+    void Execute();
+    void ExecuteVector();
+    void ExecuteDiscard();
+    void Fail(const std::string &error);
+
+    std::vector<int8_t> rxbuf;
+    COMMANDSTRUCT rxcmd;     // the data member is not part of the header
+    size_t rxheaderlen;      // bytes of the header received so far
+    int8_t *rxpayload;       // everything behind the header of write, vectored and discard commands
+    int64_t rxpayloadsize;
+    int64_t rxpayloadlen;    // bytes of the payload received so far
+    bool rxinpayload;
+    static const size_t RXBUFSIZE = 64*1024;
+    static const size_t HEADERSIZE = 32; // length, id and command description
+    static const int32_t SHORTHEADERSIZE = 12; // length, id and the command number only
+    static const int32_t MAXCOMMANDSIZE = 64*1024*1024;
+    static const int32_t MAXEXTENTS = 4096; // per vectored command
+
+    // requests in the I/O engine. Reading pauses while too many bytes are in flight
+    void Started(int64_t bytes);
+    void Finished(int8_t *replybuf, int64_t bytes, bool ok);
+    void WhenIdle(std::function<void()> f);
+    std::mutex pendingmtx;
+    int npending;
+    int64_t pendingbytes;
+    bool paused;
+    std::vector<std::function<void()>> idle; // run once all requests completed
+    static const int64_t MAXPENDINGBYTES = 64*1024*1024;
+
+    // for writing. Each reply is an aligned buffer with the header in front of the data
+    static int8_t* AllocReply(int32_t id, int64_t size);
+    void Send(int8_t *replybuf);
+    void AsyncWrite();
+    std::deque<int8_t*> txqueue;
+    std::vector<int8_t*> txinflight;
+    bool txerror;
+    static const size_t MAXGATHER = 64; // maximum number of replies per socket write
+
+    ssl_socket sock;
+    boost::asio::io_service::strand strand;
+    CServerIO &io;
+};
+
+#endif
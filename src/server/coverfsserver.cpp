@@ -2,182 +2,65 @@
 #include <unistd.h>
 
 #include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <thread>
-#include <cassert>
+#include <vector>
+#include <memory>
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 
 #include "Logger.h"
+#include "CServerIO.h"
+#include "CServerSession.h"
 
 using boost::asio::ip::tcp;
 
-typedef boost::asio::ssl::stream<boost::asio::ip::tcp::socket> ssl_socket;
+std::unique_ptr<CServerIO> io;
 
-FILE *fp;
-int64_t filesize;
-
-enum class COMMAND {read, write, size, info, close};
-
-typedef struct
-{
-    int32_t cmdlen;
-    int32_t id;
-    int32_t cmd;
-    int32_t dummy;
-    int64_t offset;
-    int64_t length;
-    int64_t data;
-} COMMANDSTRUCT;
-
-typedef struct
-{
-    int32_t cmdlen;
-    int32_t id;
-    int8_t data;
-} REPLYCOMMANDSTRUCT;
-
-
-void ParseCommand(char *commandbuf, ssl_socket &sock)
+std::string get_password(std::size_t max_length, boost::asio::ssl::context::password_purpose purpose)
 {
-    //COMMANDSTRUCT *cmd = reinterpret_cast<COMMANDSTRUCT*>(commandbuf);
-    auto *cmd = (COMMANDSTRUCT*)commandbuf;
-    LOG(LogLevel::INFO) << "received command " << cmd->cmd << " with len=" << cmd->cmdlen;
-
-    assert(cmd->cmdlen >= 8);
-    switch((COMMAND)cmd->cmd)
-    {
-    case COMMAND::read:
-        {
-            //printf("READ ofs=%li size=%li (block: %li)\n", cmd->offset, cmd->length, cmd->offset/4096);
-            fseek(fp, cmd->offset, SEEK_SET);
-            auto *data = new int8_t[cmd->length+8];
-            auto *reply = (REPLYCOMMANDSTRUCT*)data;
-            reply->cmdlen = cmd->length+8;
-            reply->id = cmd->id;
-            size_t nread = fread(&reply->data, cmd->length, 1, fp);
-            if (nread == 0)
-            {
-                filesize = ftell(fp);
-                if (cmd->offset+cmd->length >= filesize)
-                {
-                    LOG(LogLevel::WARN) << "Read outside of file boundary";
-                } else
-                {
-                   throw std::runtime_error(std::string("Cannot read ") + std::to_string(cmd->length) + " bytes from container");
-                }
-            }
-            boost::asio::write(sock, boost::asio::buffer(reply, reply->cmdlen));
-            delete[] data;
-            break;
-        }
-    case COMMAND::write:
-        {
-            //printf("WRITE ofs=%li size=%li (block: %li)\n", cmd->offset, cmd->length, cmd->offset/4096);
-            fseek(fp, cmd->offset, SEEK_SET);
-            size_t nwrite = fwrite(&cmd->data, cmd->length, 1, fp);
-            if (nwrite == 0) {
-                throw std::runtime_error(
-                        std::string("Cannot write ") + std::to_string(cmd->length) + " bytes into container");
-            }
-            break;
-        }
-    case COMMAND::size:
-        {
-            //printf("SIZE\n");
-            fseek(fp, 0L, SEEK_END);
-            filesize = ftell(fp);
-            fseek(fp, 0L, SEEK_SET);
-            int32_t data[4];
-            auto *reply = (REPLYCOMMANDSTRUCT*)data;
-            reply->cmdlen = 16;
-            reply->id = cmd->id;
-            memcpy(&reply->data, &filesize, 8);
-            boost::asio::write(sock, boost::asio::buffer(reply, reply->cmdlen));
-            break;
-        }
-
-    case COMMAND::info:
-        {
-            //printf("INFO\n");
-            char data[44];
-            memset(data, 0, 44);
-            auto *reply = (REPLYCOMMANDSTRUCT*)data;
-            reply->cmdlen = 44;
-            reply->id = cmd->id;
-            strncpy((char*)&reply->data, "CoverFS Server V 1.0", 36);
-            boost::asio::write(sock, boost::asio::buffer(reply, reply->cmdlen));
-            break;
-        }
-
-    case COMMAND::close:
-        {
-            //printf("CLOSE\n");
-            REPLYCOMMANDSTRUCT reply{};
-            reply.cmdlen = 8;
-            reply.id = cmd->id;
-            boost::asio::write(sock, boost::asio::buffer(&reply, reply.cmdlen));
-            break;
-        }
-
-    }
-
+    char *password = getpass("Password for private key: ");
+    return std::string(password);
 }
 
-void ParseStream(const char *data, int length, ssl_socket &sock, char *commandbuf, int32_t &commandbuflen)
+void StartAccept(boost::asio::io_service& io_service, tcp::acceptor &a, boost::asio::ssl::context &ctx)
 {
-    for(int i=0; i<length; i++)
+    auto session = std::make_shared<CServerSession>(io_service, ctx, *io);
+    a.async_accept(session->GetSocket().lowest_layer(),
+    [&io_service, &a, &ctx, session](const boost::system::error_code &ec)
     {
-        commandbuf[commandbuflen++] = data[i];
-        if (commandbuflen < 4) continue;
-        int32_t len=0;
-        memcpy(&len, commandbuf, 4); // to prevent the aliasing warning
-        if (len <= commandbuflen)
+        if (ec)
         {
-            ParseCommand(commandbuf, sock);
-            memset(commandbuf, 0xFF, commandbuflen);
-            commandbuflen = 0;
-        }
-    }
-}
-
-
-void session(ssl_socket *sock)
-{
-    const int max_length = 4096*10;
-    char data[max_length];
-
-    char commandbuf[4096*2];
-    int32_t commandbuflen = 0;
-
-    try
-    {
-        for (;;)
+            LOG(LogLevel::ERR) << "Accept failed: " << ec.message();
+        } else
         {
-            boost::system::error_code error;
-            size_t length = sock->read_some(boost::asio::buffer(data, max_length), error);
-            /*
-                if (error == boost::asio::error::eof) break; // Connection closed cleanly by peer.
-                else if (error) throw boost::system::system_error(error); // Some other error.
-            */
-            if (error) break;
-            ParseStream(data, length, *sock, commandbuf, commandbuflen);
+            boost::system::error_code epec;
+            auto endpoint = session->GetSocket().lowest_layer().remote_endpoint(epec);
+            LOG(LogLevel::INFO)
+                << "Connection from '"
+                << (epec?std::string("unknown"):endpoint.address().to_string())
+                << "'. Establish SSL connection";
+            session->Start();
         }
-    }
-    catch (std::exception& e)
-    {
-        LOG(LogLevel::ERR) << "Exception in thread: " << e.what();
-    }
-    LOG(LogLevel::INFO) << "Connection closed";
+        StartAccept(io_service, a, ctx);
+    });
 }
 
-std::string get_password(std::size_t max_length, boost::asio::ssl::context::password_purpose purpose)
+// the engine statistics are logged periodically while there is activity
+void LogStats(boost::asio::deadline_timer &timer)
 {
-    char *password = getpass("Password for private key: ");
-    return std::string(password);
+    timer.expires_from_now(boost::posix_time::seconds(60));
+    timer.async_wait([&timer](const boost::system::error_code &ec)
+    {
+        if (ec) return;
+        io->LogStats();
+        LogStats(timer);
+    });
 }
 
-void server(boost::asio::io_service& io_service, unsigned short port)
+void server(boost::asio::io_service& io_service, unsigned short port, int nthreads)
 {
     // Create a context that uses the default paths for
     // finding CA certificates.
@@ -200,39 +83,52 @@ void server(boost::asio::io_service& io_service, unsigned short port)
 
     LOG(LogLevel::INFO) << "Start listening on port " << port;
     tcp::acceptor a(io_service, tcp::endpoint(tcp::v4(), port));
+    StartAccept(io_service, a, ctx);
+    boost::asio::deadline_timer statstimer(io_service);
+    LogStats(statstimer);
 
-    for (;;)
+    // all connections are served by the same pool of io threads
+    std::vector<std::thread> threads;
+    for(int i=0; i<std::max(nthreads, 1); i++)
     {
-        try
+        threads.emplace_back([&io_service]
         {
-            auto *sock = new ssl_socket(io_service, ctx);
-            a.accept(sock->lowest_layer());
-            LOG(LogLevel::INFO)
-                << "Connection from '" 
-                << sock->lowest_layer().remote_endpoint().address().to_string()
-                << "'. Establish SSL connection";
-
-            sock->handshake(boost::asio::ssl::stream_base::server);
-
-            std::thread(session, sock).detach();
-            //session(sock);
-        }
-        catch (std::exception& e)
-        {
-            LOG(LogLevel::ERR) << "Exception: " << e.what();
-        }
-        catch (...) // No matter what happens, continue
-        {
-            LOG(LogLevel::ERR) << "Unknown connection problem. Connection closed";
-        }
-
+            for (;;)
+            {
+                try
+                {
+                    io_service.run();
+                    return;
+                }
+                catch (std::exception& e)
+                {
+                    LOG(LogLevel::ERR) << "Exception: " << e.what();
+                }
+                catch (...) // No matter what happens, continue
+                {
+                    LOG(LogLevel::ERR) << "Unknown connection problem";
+                }
+            }
+        });
     }
+    for(auto &t : threads) t.join();
 }
 
 void PrintUsage(char *argv[])
 {
-    printf("Usage: %s [port]\n", argv[0]);
+    printf("Usage: %s [options] [port]\n", argv[0]);
     printf("The default port is 62000\n");
+    printf("Options:\n");
+    printf("  --help           Print this help\n");
+    printf("  --threads [n]    Number of disk worker threads (default: 4)\n");
+    printf("  --netthreads [n] Number of threads serving the connections (default: number of cores)\n");
+    printf("  --direct         Bypass the page cache with O_DIRECT\n");
+    printf("  --uring          Use io_uring if available\n");
+    printf("  --cache [MB]     Size of the block cache for reads (default: 0)\n");
+    printf("  --sync [mode]    When written data is synced besides on flush requests:\n");
+    printf("                   'async' (default), 'group' or 'write'\n");
+    printf("  --syncinterval [ms] Interval of the group commit (default: 100)\n");
+    printf("  --syncbytes [MB] Group commit after this amount of written data (default: 64)\n");
 }
 
 int main(int argc, char *argv[])
@@ -240,24 +136,62 @@ int main(int argc, char *argv[])
     static_assert(sizeof(COMMANDSTRUCT) == 40, "");
     boost::asio::io_service io_service;
     int defaultport = 62000;
+    CServerIOConfig ioconfig;
+    int nnetthreads = std::thread::hardware_concurrency();
 
-    if (argc > 2)
-    {
-        PrintUsage(argv);
-        return 0;
-    }
-    if (argc == 2)
+    for(int i=1; i<argc; i++)
     {
-        if (strcmp(argv[1], "--help") == 0)
+        if (strcmp(argv[i], "--help") == 0)
+        {
+            PrintUsage(argv);
+            return 0;
+        } else if ((strcmp(argv[i], "--threads") == 0) && (i+1 < argc))
+        {
+            ioconfig.nthreads = std::atoi(argv[++i]);
+        } else if ((strcmp(argv[i], "--netthreads") == 0) && (i+1 < argc))
+        {
+            nnetthreads = std::atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--direct") == 0)
+        {
+            ioconfig.direct = true;
+        } else if (strcmp(argv[i], "--uring") == 0)
+        {
+            ioconfig.uring = true;
+        } else if ((strcmp(argv[i], "--cache") == 0) && (i+1 < argc))
+        {
+            ioconfig.cachesize = std::atoll(argv[++i])*1024*1024;
+        } else if ((strcmp(argv[i], "--sync") == 0) && (i+1 < argc))
+        {
+            i++;
+            if (strcmp(argv[i], "async") == 0)
+                ioconfig.syncmode = CServerIOConfig::SYNCMODE::async;
+            else if (strcmp(argv[i], "group") == 0)
+                ioconfig.syncmode = CServerIOConfig::SYNCMODE::group;
+            else if (strcmp(argv[i], "write") == 0)
+                ioconfig.syncmode = CServerIOConfig::SYNCMODE::write;
+            else
+            {
+                PrintUsage(argv);
+                return 0;
+            }
+        } else if ((strcmp(argv[i], "--syncinterval") == 0) && (i+1 < argc))
+        {
+            ioconfig.syncinterval = std::max(std::atoi(argv[++i]), 1);
+        } else if ((strcmp(argv[i], "--syncbytes") == 0) && (i+1 < argc))
+        {
+            ioconfig.syncbytes = std::max(std::atoll(argv[++i]), 1LL)*1024*1024;
+        } else if ((argv[i][0] != '-') && (i == argc-1))
+        {
+            defaultport = std::atoi(argv[i]);
+        } else
         {
             PrintUsage(argv);
             return 0;
         }
-        defaultport = std::atoi(argv[1]);
     }
 
     const char filename[] = "cfscontainer";
-    fp = fopen(filename, "r+b");
+    FILE *fp = fopen(filename, "rb");
 
     if (fp == nullptr)
     {
@@ -270,18 +204,13 @@ int main(int argc, char *argv[])
         }
         char data[4096*3] = {0};
         fwrite(data, sizeof(data), 1, fp);
-        fclose(fp);
-        fp = fopen(filename, "r+b");
-        if (fp == nullptr)
-        {
-            LOG(LogLevel::ERR) << "Cannot open file";
-            return 1;
-        }
     }
+    fclose(fp);
 
     try
     {
-        server(io_service, defaultport);
+        io.reset(new CServerIO(filename, ioconfig));
+        server(io_service, defaultport, nnetthreads);
     }
     catch(std::exception &e)
     {
@@ -0,0 +1,14 @@
+#ifndef NETPROTOCOL_H
+#define NETPROTOCOL_H
+
+#include <cstdint>
+
+// Commands of the network protocol, shared by client and server
+enum class COMMAND : int32_t {READ=0, WRITE=1, SIZE=2, CONTAINERINFO=3, CLOSE=4, READV=5, WRITEV=6, FLUSH=7, DISCARD=8};
+
+// flags at the end of the CONTAINERINFO reply. Older servers leave them zero
+static const int32_t CAPABILITY_VECTORED = 1;
+static const int32_t CAPABILITY_FLUSH = 2;
+static const int32_t CAPABILITY_DISCARD = 4;
+
+#endif
@@ -0,0 +1,648 @@
+#include<cstdio>
+#include<cstdlib>
+#include<cstring>
+#include<algorithm>
+#include<thread>
+#include<chrono>
+#include<atomic>
+#include<vector>
+#include<memory>
+#include<list>
+#include<mutex>
+#include<unistd.h>
+#ifdef __GLIBC__
+#include<malloc.h>
+#endif
+
+#include"Logger.h"
+#include"../src/IO/CBlockIO.h"
+#include"../src/IO/CEncrypt.h"
+#include"../src/IO/CCipher.h"
+#include"../src/IO/CCacheIO.h"
+#include"../src/IO/CSlabAllocator.h"
+#include"../src/IO/CNetReadWriteBuffer.h"
+#include"../src/IO/CNetBlockIO.h"
+
+// ----------------------
+
+static const int blocksize = 4096;
+static std::atomic<int> sink(0); // prevents the compiler from optimizing the loops away
+
+inline int fastrand(unsigned int &g_seed)
+{
+  g_seed = (214013*g_seed+2531011);
+  return (g_seed>>16)&0x7FFF;
+}
+
+static double GetTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// ----------------------
+// Lookup of cached blocks from several threads.
+
+void BenchmarkCache()
+{
+    const int nblocks = 16384;
+    const int niter = 200000;
+
+    auto bio = std::make_shared<CRAMBlockIO>(blocksize);
+    char pass[] = "benchmark";
+    CEncrypt enc(*bio, pass);
+    CCacheConfig config;
+    config.maxcachesize = (int64_t)nblocks*blocksize*2;
+    CCacheIO cbio(bio, enc, false, config);
+    cbio.CacheBlocks(1, nblocks);
+
+    printf("cache lookup: %i blocks, %i lookups per thread\n", nblocks, niter);
+    printf("%8s %14s %14s\n", "threads", "Mlookups/s", "speedup");
+    double base = 0.;
+    for(int nthreads=1; nthreads<=32; nthreads*=2)
+    {
+        std::vector<std::thread> t;
+        double start = GetTime();
+        for(int i=0; i<nthreads; i++)
+        {
+            t.emplace_back([&cbio, i]()
+            {
+                unsigned int seed = 0xA0A0A0+i;
+                int sum = 0;
+                for(int j=0; j<niter; j++)
+                {
+                    int blockidx = 1 + ((fastrand(seed)<<15) | fastrand(seed)) % nblocks;
+                    CBLOCKPTR block = cbio.GetBlock(blockidx);
+                    int8_t c;
+                    block->ReadBuf(0, 1, &c);
+                    sum += c;
+                }
+                sink += sum;
+            });
+        }
+        for(auto &th : t) th.join();
+        double rate = (double)nthreads*niter/(GetTime()-start)*1e-6;
+        if (nthreads == 1) base = rate;
+        printf("%8i %14.2f %14.2f\n", nthreads, rate, rate/base);
+    }
+}
+
+// ----------------------
+// Memory footprint of cached blocks
+
+// Discards writes and reads zeros. Keeps the memory of the backend out of the measurement.
+class CNullBlockIO : public CAbstractBlockIO
+{
+public:
+    explicit CNullBlockIO(int _blocksize) : CAbstractBlockIO(_blocksize) {}
+    void Read(int blockidx, int n, int8_t* d) override { memset(d, 0, (size_t)n*blocksize); }
+    void Write(int blockidx, int n, int8_t* d) override {}
+    int64_t GetFilesize() override { return 0; }
+};
+
+static int64_t GetRSS()
+{
+    long pages = 0, rss = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp == nullptr) return 0;
+    if (fscanf(fp, "%ld %ld", &pages, &rss) != 2) rss = 0;
+    fclose(fp);
+    return (int64_t)rss*sysconf(_SC_PAGESIZE);
+}
+
+// Layout of a block before the slabs: the buffer is a std::vector and the
+// descriptor is allocated separately from the reference counter.
+struct CLegacyBlock
+{
+    int nextdirtyidx = -1;
+    bool dirty = false;
+    int blockidx = 0;
+    std::mutex mutex;
+    void *cio = nullptr;
+    void *enc = nullptr;
+    std::vector<int8_t> buf;
+    uint32_t count = 0;
+    int queue = 0;
+    std::list<int>::iterator queueit;
+};
+
+struct CSlabBlock
+{
+    int nextdirtyidx = -1;
+    bool dirty = false;
+    int blockidx = 0;
+    std::mutex mutex;
+    void *cio = nullptr;
+    int8_t *buf = nullptr;
+    int queue = 0;
+    std::list<int>::iterator queueit;
+};
+
+static void PrintMemory(const char *layout, int64_t rss, double time, int nblocks)
+{
+    printf("%-10s %10.1f %14.1f %14.1f %10.3f\n",
+        layout, rss/(1024.*1024.), (double)rss/nblocks, (double)rss/nblocks-blocksize, time);
+}
+
+void BenchmarkMemory(int nblocks)
+{
+    printf("memory footprint: %i cached blocks of %i bytes\n", nblocks, blocksize);
+    printf("%-10s %10s %14s %14s %10s\n", "layout", "RSS [MB]", "bytes/block", "overhead", "time [s]");
+    {
+        int64_t rss = GetRSS();
+        double start = GetTime();
+        std::vector<std::shared_ptr<CLegacyBlock>> blocks(nblocks);
+        for(int i=0; i<nblocks; i++)
+        {
+            blocks[i] = std::shared_ptr<CLegacyBlock>(new CLegacyBlock());
+            blocks[i]->buf.assign(blocksize, 0);
+        }
+        PrintMemory("legacy", GetRSS()-rss, GetTime()-start, nblocks);
+    }
+#ifdef __GLIBC__
+    malloc_trim(0); // give the freed heap back to the system
+#endif
+    {
+        int64_t rss = GetRSS();
+        double start = GetTime();
+        CSlabAllocator bufferslab(blocksize, 2*1024*1024);
+        using CSlabBlockAllocator = CSlabSTLAllocator<CSlabBlock, sizeof(CSlabBlock)+64>;
+        CSlabAllocator blockslab(CSlabBlockAllocator::SLOTBYTES, 2*1024*1024);
+        std::vector<std::shared_ptr<CSlabBlock>> blocks(nblocks);
+        for(int i=0; i<nblocks; i++)
+        {
+            blocks[i] = std::allocate_shared<CSlabBlock>(CSlabBlockAllocator(blockslab));
+            blocks[i]->buf = static_cast<int8_t*>(bufferslab.Allocate());
+            memset(blocks[i]->buf, 0, blocksize);
+        }
+        PrintMemory("slab", GetRSS()-rss, GetTime()-start, nblocks);
+        for(auto &block : blocks) bufferslab.Free(block->buf);
+        blocks.clear();
+    }
+    {
+        // the complete cache including the index of the shards and the 2Q queues
+        int64_t rss = GetRSS();
+        double start = GetTime();
+        auto bio = std::make_shared<CNullBlockIO>(blocksize);
+        char pass[] = "benchmark";
+        CEncrypt enc(*bio, pass);
+        CCacheConfig config;
+        config.maxcachesize = (int64_t)nblocks*blocksize*2;
+        CCacheIO cbio(bio, enc, false, config);
+        for(int i=0; i<nblocks; i+=64)
+            cbio.CacheBlocks(i, std::min(64, nblocks-i));
+        PrintMemory("cache", GetRSS()-rss, GetTime()-start, nblocks);
+    }
+}
+
+// ----------------------
+// Single-core throughput of the block cipher engines
+
+static void BenchmarkCipherEngine(const char *name, CCipher &c)
+{
+    const int niter = 50000;
+    std::vector<int8_t> buf(blocksize, 1);
+
+    double start = GetTime();
+    for(int j=0; j<niter; j++) c.Encrypt(1+j, buf.data(), blocksize);
+    double enc = (double)niter*blocksize/(GetTime()-start)/1e9;
+
+    start = GetTime();
+    for(int j=0; j<niter; j++) c.Decrypt(1+j, buf.data(), blocksize);
+    double dec = (double)niter*blocksize/(GetTime()-start)/1e9;
+
+    sink += buf[0];
+    printf("%12s %14.2f %14.2f\n", name, enc, dec);
+}
+
+void BenchmarkCipher()
+{
+    uint8_t key[64];
+    for(int i=0; i<64; i++) key[i] = i*7+1;
+
+    printf("cipher engines: GB/s per core\n");
+    printf("%12s %14s %14s\n", "cipher", "encrypt", "decrypt");
+    CCipherCBC cbc(key);
+    BenchmarkCipherEngine("AES-256-CBC", cbc);
+    CCipherXTS xts(key);
+    BenchmarkCipherEngine("AES-256-XTS", xts);
+}
+
+// ----------------------
+// Encryption and decryption throughput from several threads.
+
+void BenchmarkCrypto(int maxthreads)
+{
+    const int niter = 20000;
+
+    auto bio = std::make_shared<CRAMBlockIO>(blocksize);
+    char pass[] = "benchmark";
+    CEncrypt enc(*bio, pass);
+
+    printf("crypto: %i blocks encrypted and decrypted per thread\n", niter);
+    printf("%8s %14s %14s\n", "threads", "MB/s", "speedup");
+    double base = 0.;
+    for(int nthreads=1; nthreads<=maxthreads; nthreads*=2)
+    {
+        std::vector<std::thread> t;
+        double start = GetTime();
+        for(int i=0; i<nthreads; i++)
+        {
+            t.emplace_back([&enc, i]()
+            {
+                std::vector<int8_t> buf(blocksize, (int8_t)i);
+                for(int j=0; j<niter; j++)
+                {
+                    enc.Encrypt(1+j, buf.data());
+                    enc.Decrypt(1+j, buf.data());
+                }
+                sink += buf[0];
+            });
+        }
+        for(auto &th : t) th.join();
+        double rate = 2.*nthreads*niter*blocksize/(GetTime()-start)/1e6;
+        if (nthreads == 1) base = rate;
+        printf("%8i %14.1f %14.2f\n", nthreads, rate, rate/base);
+    }
+
+    // one caller with ranges of 256 blocks which are split among the worker threads
+    const int nrange = 256;
+    printf("\ncrypto: ranges of %i blocks from one thread\n", nrange);
+    printf("%8s %14s %14s\n", "threads", "MB/s", "speedup");
+    std::vector<int8_t> buf((int64_t)nrange*blocksize, 1);
+    for(int nthreads=1; nthreads<=maxthreads; nthreads*=2)
+    {
+        CEncrypt encrange(*bio, pass, nthreads);
+        double start = GetTime();
+        for(int j=0; j<niter/nrange*4; j++)
+        {
+            encrange.EncryptRange(1, nrange, buf.data());
+            encrange.DecryptRange(1, nrange, buf.data());
+        }
+        double rate = 2.*(niter/nrange*4)*nrange*blocksize/(GetTime()-start)/1e6;
+        if (nthreads == 1) base = rate;
+        printf("%8i %14.1f %14.2f\n", nthreads, rate, rate/base);
+    }
+    sink += buf[0];
+}
+
+// ----------------------
+// Throughput of the send buffer of a connection over a local SSL connection.
+// The certificate is taken from ssl/ like the server does.
+
+void BenchmarkNetWrite(int64_t totalsize)
+{
+    boost::asio::io_service io_service;
+    boost::asio::io_service server_io_service;
+
+    ssl::context serverctx(ssl::context::sslv23);
+    ssl::context clientctx(ssl::context::sslv23);
+    try
+    {
+        serverctx.use_certificate_chain_file("ssl/server.crt");
+        serverctx.use_private_key_file("ssl/server.key", ssl::context::pem);
+    } catch(boost::system::system_error &e)
+    {
+        printf("Cannot load ssl/server.crt or ssl/server.key: %s\n", e.what());
+        return;
+    }
+    clientctx.set_verify_mode(ssl::verify_none);
+
+    tcp::acceptor acceptor(server_io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0));
+    ssl_socket server(server_io_service, serverctx);
+    ssl_socket client(io_service, clientctx);
+
+    std::thread acceptthread([&]()
+    {
+        acceptor.accept(server.lowest_layer());
+        server.handshake(ssl::stream_base::server);
+    });
+    client.lowest_layer().connect(acceptor.local_endpoint());
+    client.handshake(ssl::stream_base::client);
+    acceptthread.join();
+
+    std::unique_ptr<boost::asio::io_service::work> work(new boost::asio::io_service::work(io_service));
+    std::thread iothread([&io_service](){ io_service.run(); });
+
+    std::atomic<int64_t> received(0);
+    std::thread drainthread([&]()
+    {
+        std::vector<char> buf(1024*1024);
+        boost::system::error_code ec;
+        for(;;)
+        {
+            size_t n = server.read_some(boost::asio::buffer(buf), ec);
+            if (ec) return;
+            received += n;
+        }
+    });
+
+    {
+        CNetReadWriteBuffer rb(client);
+        printf("netwrite: %li MB through Write() per packet size\n", (long)(totalsize>>20));
+        printf("%12s %14s\n", "packet", "MB/s");
+        std::vector<int8_t> packet(1024*1024, 1);
+        int64_t expected = 0;
+        for(int size : {32, 4096+24, 64*1024+24, 1024*1024-8})
+        {
+            int64_t npackets = totalsize/size;
+            double start = GetTime();
+            for(int64_t i=0; i<npackets; i++)
+                rb.Write((int32_t)i, packet.data(), size);
+            expected += npackets*(size+8);
+            while(received.load() < expected)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            printf("%12i %14.1f\n", size, npackets*(size+8)/(GetTime()-start)/1e6);
+        }
+
+        // handlers must not run after the buffer is destroyed
+        work.reset();
+        io_service.stop();
+        iothread.join();
+    }
+    boost::system::error_code ec;
+    client.lowest_layer().shutdown(tcp::socket::shutdown_both, ec);
+    drainthread.join();
+}
+
+// ----------------------
+// Local stand-in server, which answers reads with zeros and discards writes.
+// So only the transport is measured.
+
+class CStandInServer
+{
+public:
+    explicit CStandInServer(bool _vectored);
+    ~CStandInServer();
+    std::string GetPort();
+
+    std::atomic<int64_t> ncommands;
+    std::atomic<int64_t> nwritten; // bytes of payload
+
+private:
+    void Session(ssl_socket *sock);
+
+    bool vectored; // announce READV and WRITEV
+    boost::asio::io_service io_service;
+    ssl::context ctx;
+    tcp::acceptor acceptor;
+    std::vector<std::thread> sessions;
+    std::atomic<bool> stop;
+    std::thread acceptthread;
+};
+
+CStandInServer::CStandInServer(bool _vectored)
+: ncommands(0), nwritten(0), vectored(_vectored), ctx(ssl::context::sslv23),
+  acceptor(io_service, tcp::endpoint(boost::asio::ip::address_v4::loopback(), 0)), stop(false)
+{
+    ctx.use_certificate_chain_file("ssl/server.crt");
+    ctx.use_private_key_file("ssl/server.key", ssl::context::pem);
+
+    acceptthread = std::thread([this]()
+    {
+        for(;;)
+        {
+            auto *sock = new ssl_socket(io_service, ctx);
+            boost::system::error_code ec;
+            acceptor.accept(sock->lowest_layer(), ec);
+            if (ec || stop)
+            {
+                delete sock;
+                return;
+            }
+            sock->handshake(ssl::stream_base::server, ec);
+            if (ec)
+            {
+                delete sock;
+                continue;
+            }
+            sessions.emplace_back(&CStandInServer::Session, this, sock);
+        }
+    });
+}
+
+CStandInServer::~CStandInServer()
+{
+    // wake up the blocking accept
+    stop = true;
+    tcp::socket wakeup(io_service);
+    wakeup.connect(acceptor.local_endpoint());
+    acceptthread.join();
+    for(auto &th : sessions) th.join();
+}
+
+std::string CStandInServer::GetPort()
+{
+    return std::to_string(acceptor.local_endpoint().port());
+}
+
+void CStandInServer::Session(ssl_socket *sock)
+{
+    std::vector<int8_t> buf(64*1024);
+    std::vector<int8_t> reply(8+64*4096, 0);
+    try
+    {
+        for(;;)
+        {
+            int32_t header[2]; // length and id
+            boost::asio::read(*sock, boost::asio::buffer(header, 8));
+            size_t len = header[0]-8;
+            if (buf.size() < len) buf.resize(len);
+            boost::asio::read(*sock, boost::asio::buffer(buf.data(), len));
+            ncommands++;
+            int32_t cmd;
+            int64_t length;
+            memcpy(&cmd, &buf[0], 4);
+            memcpy(&length, &buf[16], 8);
+            int32_t replylen = 8;
+            if ((cmd == 1) || (cmd == 6)) // write, writev
+            {
+                nwritten += length;
+                continue;
+            }
+            if ((cmd == 0) || (cmd == 5)) replylen += length; // read, readv
+            if (cmd == 2) replylen += 8; // size
+            if (cmd == 3) replylen += 36; // info
+            if ((int32_t)reply.size() < replylen) reply.resize(replylen, 0);
+            memcpy(&reply[0], &replylen, 4);
+            memcpy(&reply[4], &header[1], 4);
+            int32_t capabilities = (vectored?1:0) | 2; // flushes are answered right away
+            if (cmd == 3) memcpy(&reply[8+32], &capabilities, 4);
+            boost::asio::write(*sock, boost::asio::buffer(reply.data(), replylen));
+        }
+    } catch(...)
+    {
+        // the client closed the connection
+    }
+    delete sock;
+}
+
+// ----------------------
+// Striped connections against the stand-in server
+
+void BenchmarkNet(int maxconnections)
+{
+    const int nthreads = 8;
+    const int nblocks = 64; // per request
+    const double duration = 2.;
+
+    std::unique_ptr<CStandInServer> server;
+    try
+    {
+        server.reset(new CStandInServer(false));
+    } catch(boost::system::system_error &e)
+    {
+        printf("Cannot load ssl/server.crt or ssl/server.key: %s\n", e.what());
+        return;
+    }
+    std::string port = server->GetPort();
+
+    printf("net: %i threads with requests of %i blocks\n", nthreads, nblocks);
+    printf("%12s %14s %14s\n", "connections", "read MB/s", "write MB/s");
+    for(int nconnections=1; nconnections<=maxconnections; nconnections*=2)
+    {
+        CNetConfig config;
+        config.nconnections = nconnections;
+        config.niothreads = nconnections;
+        CNetBlockIO bio(blocksize, "127.0.0.1", port, config);
+        double rate[2];
+        for(int write=0; write<2; write++)
+        {
+            std::atomic<int64_t> nrequests(0);
+            std::vector<std::thread> t;
+            double start = GetTime();
+            for(int i=0; i<nthreads; i++)
+            {
+                t.emplace_back([&, i]()
+                {
+                    std::vector<int8_t> buf(nblocks*blocksize, 1);
+                    for(int j=0; GetTime()-start < duration; j++)
+                    {
+                        int blockidx = (i*1024 + j*nblocks) % (1024*1024);
+                        if (write)
+                            bio.Write(blockidx, nblocks, buf.data());
+                        else
+                            bio.Read(blockidx, nblocks, buf.data());
+                        nrequests++;
+                    }
+                });
+            }
+            for(auto &th : t) th.join();
+            while(bio.GetWriteCache() > 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            rate[write] = (double)nrequests*nblocks*blocksize/(GetTime()-start)/1e6;
+        }
+        printf("%12i %14.1f %14.1f\n", nconnections, rate[0], rate[1]);
+    }
+}
+
+// ----------------------
+// Writeback of random 4 KB blocks through the cache, with one command per block
+// or with vectored writes
+
+void BenchmarkWriteV(int nblocks)
+{
+    const int range = 1024*1024; // in blocks
+
+    printf("writev: writeback of %i random blocks\n", nblocks);
+    printf("%12s %14s %14s\n", "vectored", "commands", "blocks/s");
+    for(int vectored=0; vectored<2; vectored++)
+    {
+        std::unique_ptr<CStandInServer> server;
+        try
+        {
+            server.reset(new CStandInServer(vectored));
+        } catch(boost::system::system_error &e)
+        {
+            printf("Cannot load ssl/server.crt or ssl/server.key: %s\n", e.what());
+            return;
+        }
+        auto bio = std::make_shared<CNetBlockIO>(blocksize, "127.0.0.1", server->GetPort());
+        char pass[] = "benchmark";
+        CEncrypt enc(*bio, pass);
+        CCacheConfig config;
+        config.maxcachesize = (int64_t)nblocks*blocksize*2;
+        config.dirtyhigh = config.maxcachesize;
+        config.dirtylow = config.maxcachesize;
+        CCacheIO cache(bio, enc, false, config);
+
+        // the writeback may start while the blocks are still written
+        int64_t ncommands = server->ncommands.load();
+        int64_t nwritten = server->nwritten.load();
+        double start = GetTime();
+        unsigned int seed = 1;
+        std::vector<int8_t> buf(blocksize, 1);
+        std::vector<bool> written(range, false);
+        int64_t nunique = 0;
+        for(int i=0; i<nblocks; i++)
+        {
+            int blockidx = (fastrand(seed)*32768 + fastrand(seed)) % range;
+            if (!written[blockidx]) nunique++;
+            written[blockidx] = true;
+            cache.Write((int64_t)(16+blockidx)*blocksize, blocksize, buf.data());
+        }
+        cache.Sync();
+        while(server->nwritten.load()-nwritten < nunique*blocksize)
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+        double time = GetTime()-start;
+        printf("%12s %14li %14.0f\n", vectored?"yes":"no", (long)(server->ncommands.load()-ncommands), nblocks/time);
+    }
+}
+
+// ----------------------
+
+void PrintUsage(char *argv[])
+{
+    printf("Usage: %s benchmark [n]\n", argv[0]);
+    printf("Benchmarks:\n");
+    printf("  cache     Scaling of concurrent block lookups in the cache\n");
+    printf("  cipher    Throughput of the block cipher engines on one core\n");
+    printf("  crypto    Scaling of encryption with up to [n] threads. default: number of cores\n");
+    printf("  netwrite  Throughput of the send buffer with [n] MB per packet size. default: 256\n");
+    printf("  net       Striping over up to [n] connections to a local server. default: 8\n");
+    printf("  writev    Writeback of [n] random blocks with and without vectored writes. default: 65536\n");
+    printf("  memory    Memory footprint of [n] cached blocks. default: 1048576\n");
+}
+
+int main(int argc, char *argv[])
+{
+    if ((argc != 2) && (argc != 3))
+    {
+        PrintUsage(argv);
+        return 1;
+    }
+    Logger().Set(LogLevel::WARN);
+
+    if (strcmp(argv[1], "cache") == 0)
+    {
+        BenchmarkCache();
+    } else
+    if (strcmp(argv[1], "cipher") == 0)
+    {
+        BenchmarkCipher();
+    } else
+    if (strcmp(argv[1], "crypto") == 0)
+    {
+        BenchmarkCrypto((argc == 3)?atoi(argv[2]):std::max(1u, std::thread::hardware_concurrency()));
+    } else
+    if (strcmp(argv[1], "netwrite") == 0)
+    {
+        BenchmarkNetWrite((int64_t)((argc == 3)?atoi(argv[2]):256)*1024*1024);
+    } else
+    if (strcmp(argv[1], "net") == 0)
+    {
+        BenchmarkNet((argc == 3)?atoi(argv[2]):8);
+    } else
+    if (strcmp(argv[1], "writev") == 0)
+    {
+        BenchmarkWriteV((argc == 3)?atoi(argv[2]):65536);
+    } else
+    if (strcmp(argv[1], "memory") == 0)
+    {
+        BenchmarkMemory((argc == 3)?atoi(argv[2]):1024*1024);
+    } else
+    {
+        PrintUsage(argv);
+        return 1;
+    }
+    return 0;
+}